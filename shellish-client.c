@@ -0,0 +1,135 @@
+// Thin client for 'shellish --serve'
+// Sends a command to a running server together with this process's stdin,
+// stdout and stderr, waits for the reply and exits with the command's
+// status. The arguments travel as an argv vector and reach the program
+// exactly as given here; -c sends a shell command line to be parsed by the
+// server instead. Build: gcc -o shellish-client shellish-client.c
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVE_MAX_LINE 4096
+
+// Must match the definitions in shellish-skeleton.c
+struct serve_request {
+  uint32_t id;
+  uint32_t argc; // line holds argc NUL terminated words, 0 for a command line
+  char cwd[PATH_MAX];
+  char line[SERVE_MAX_LINE];
+};
+
+struct serve_reply {
+  uint32_t id;
+  int32_t status;
+  int64_t utime_us;
+  int64_t stime_us;
+  int64_t maxrss_kb;
+};
+
+void usage() {
+  fprintf(stderr, "Usage: shellish-client [-s SOCKET] [-v] command [args...]\n"
+                  "       shellish-client [-s SOCKET] [-v] -c LINE\n"
+                  "SOCKET defaults to $SHELLISH_SOCK\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = getenv("SHELLISH_SOCK");
+  const char *line = NULL;
+  int verbose = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+      socket_path = argv[++i];
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      line = argv[++i];
+    else if (strcmp(argv[i], "-v") == 0)
+      verbose = 1;
+    else if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else
+      usage();
+  }
+  if (socket_path == NULL || (line == NULL) == (i == argc))
+    usage();
+
+  static struct serve_request request;
+  request.id = getpid();
+  if (getcwd(request.cwd, sizeof(request.cwd)) == NULL)
+    strcpy(request.cwd, "/");
+  if (line) {
+    if (strlen(line) + 1 > sizeof(request.line)) {
+      fprintf(stderr, "shellish-client: command line too long\n");
+      return 2;
+    }
+    strcpy(request.line, line);
+  }
+  // each argument is copied with its NUL, so no quoting is needed
+  size_t len = 0;
+  for (; i < argc; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    if (len + n + 1 > sizeof(request.line)) {
+      fprintf(stderr, "shellish-client: command line too long\n");
+      return 2;
+    }
+    memcpy(request.line + len, argv[i], n);
+    len += n;
+    request.argc++;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "shellish-client: %s: %s\n", socket_path, strerror(errno));
+    return 2;
+  }
+
+  // Our three standard descriptors travel with the request
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {&request, sizeof(request)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, 0) == -1) {
+    fprintf(stderr, "shellish-client: send: %s\n", strerror(errno));
+    return 2;
+  }
+
+  struct serve_reply reply;
+  ssize_t n;
+  while ((n = recv(fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+    ;
+  if (n != sizeof(reply)) {
+    fprintf(stderr, "shellish-client: server closed the connection\n");
+    return 2;
+  }
+  if (reply.status == -1) {
+    fprintf(stderr, "shellish-client: server rejected the request\n");
+    return 2;
+  }
+  if (verbose)
+    fprintf(stderr, "exit %d, user %.3fs, sys %.3fs, maxrss %lld KiB\n",
+            reply.status, reply.utime_us / 1e6, reply.stime_us / 1e6,
+            (long long)reply.maxrss_kb);
+  return reply.status;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, memmem, splice and friends
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -5,12 +6,36 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 const char *sysname = "shellish";
+int last_status = 0; // exit status of the last foreground job
 
 enum return_codes {
   SUCCESS = 0,
@@ -26,8 +51,90 @@ struct command_t {
   char **args;
   char *redirects[3];     // in/out redirection
   struct command_t *next; // for piping
+  struct arena *arena;    // storage of glob expanded args
 };
 
+// Bump allocator for arguments that come in large numbers, e.g. glob
+// expansions. Everything is released at once with the command.
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used, size;
+  char data[];
+};
+
+struct arena {
+  struct arena_chunk *head;
+};
+
+char *arena_alloc(struct arena *arena, size_t len) {
+  struct arena_chunk *chunk = arena->head;
+  if (!chunk || chunk->size - chunk->used < len) {
+    size_t size = chunk ? chunk->size * 2 : 16384;
+    if (size > (1 << 20))
+      size = 1 << 20;
+    if (size < len)
+      size = len;
+    chunk = (struct arena_chunk *)malloc(sizeof(struct arena_chunk) + size);
+    chunk->next = arena->head;
+    chunk->used = 0;
+    chunk->size = size;
+    arena->head = chunk;
+  }
+  char *ptr = chunk->data + chunk->used;
+  chunk->used += len;
+  return ptr;
+}
+
+// Room a block needs at its start to be handed over with arena_adopt
+#define ARENA_HEADER offsetof(struct arena_chunk, data)
+
+/**
+ * Make a malloc'ed block part of an arena, which frees it with the rest
+ * @param block starts with ARENA_HEADER spare bytes, followed by len bytes
+ *              of data that stay where they are
+ */
+void arena_adopt(struct arena *arena, char *block, size_t len) {
+  struct arena_chunk *chunk = (struct arena_chunk *)block;
+  chunk->used = chunk->size = len;
+  if (arena->head) { // behind the head, whose free space stays in use
+    chunk->next = arena->head->next;
+    arena->head->next = chunk;
+  } else {
+    chunk->next = NULL;
+    arena->head = chunk;
+  }
+}
+
+bool arena_owns(struct arena *arena, const char *ptr) {
+  for (struct arena_chunk *c = arena ? arena->head : NULL; c; c = c->next)
+    if (ptr >= c->data && ptr < c->data + c->size)
+      return true;
+  return false;
+}
+
+/**
+ * Move every chunk of one arena into another
+ */
+void arena_merge(struct arena *into, struct arena *from) {
+  struct arena_chunk *last = from->head;
+  if (!last)
+    return;
+  while (last->next)
+    last = last->next;
+  last->next = into->head;
+  into->head = from->head;
+  from->head = NULL;
+}
+
+void arena_free(struct arena *arena) {
+  while (arena && arena->head) {
+    struct arena_chunk *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -58,12 +165,17 @@ void print_command(struct command_t *command) {
 int free_command(struct command_t *command) {
   if (command->arg_count) {
     for (int i = 0; i < command->arg_count; ++i)
-      free(command->args[i]);
+      if (!arena_owns(command->arena, command->args[i]))
+        free(command->args[i]);
     free(command->args);
   }
   for (int i = 0; i < 3; ++i)
     if (command->redirects[i])
       free(command->redirects[i]);
+  if (command->arena) {
+    arena_free(command->arena);
+    free(command->arena);
+  }
   if (command->next) {
     free_command(command->next);
     command->next = NULL;
@@ -85,6 +197,457 @@ int show_prompt() {
   return 0;
 }
 
+// Glob expansion
+// Unquoted arguments containing *, ? or [...] are expanded while parsing.
+// Directories are listed with getdents64, each path component is compiled
+// once into a small matcher, and "**" walks the tree with a pool of worker
+// threads. Expanded names live in the command's arena.
+
+enum glob_op { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_token {
+  enum glob_op op;
+  char literal;
+  bool negate;
+  uint8_t set[32]; // bitmap of the bytes a [...] class accepts
+};
+
+struct glob_pattern {
+  struct glob_token *tokens;
+  int count;
+  bool dot_ok;    // pattern itself starts with '.', so dotfiles can match
+  bool recursive; // the "**" component
+  char *literal;  // component without any wildcard, NULL otherwise
+};
+
+bool glob_has_magic(const char *text) {
+  for (; *text; text++) {
+    if (*text == '\\' && text[1])
+      text++;
+    else if (*text == '*' || *text == '?' || *text == '[')
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Remove backslash quoting in place, \x becomes x
+ */
+void glob_unquote(char *text) {
+  char *out = text;
+  for (; *text; text++) {
+    if (*text == '\\' && text[1])
+      text++;
+    *out++ = *text;
+  }
+  *out = 0;
+}
+
+/**
+ * Compile one path component into a token list
+ */
+void glob_compile(const char *text, struct glob_pattern *pattern) {
+  memset(pattern, 0, sizeof(*pattern));
+  pattern->dot_ok = text[0] == '.';
+  pattern->recursive = strcmp(text, "**") == 0;
+  if (!glob_has_magic(text)) {
+    pattern->literal = strdup(text);
+    glob_unquote(pattern->literal);
+    return;
+  }
+  pattern->tokens = (struct glob_token *)calloc(strlen(text) + 1,
+                                                sizeof(struct glob_token));
+  while (*text) {
+    struct glob_token *token = &pattern->tokens[pattern->count++];
+    char c = *text++;
+    if (c == '*') {
+      token->op = GLOB_STAR;
+      while (*text == '*')
+        text++;
+    } else if (c == '?')
+      token->op = GLOB_ANY;
+    else if (c == '[' && strchr(text + 1, ']')) {
+      token->op = GLOB_CLASS;
+      if (*text == '!' || *text == '^') {
+        token->negate = true;
+        text++;
+      }
+      bool first = true; // a ']' right after '[' is a member
+      while (*text && (*text != ']' || first)) {
+        unsigned char lo = *text++, hi = lo;
+        if (*text == '-' && text[1] && text[1] != ']') {
+          hi = text[1];
+          text += 2;
+        }
+        for (int b = lo; b <= hi; b++)
+          token->set[b >> 3] |= 1 << (b & 7);
+        first = false;
+      }
+      if (*text == ']')
+        text++;
+    } else {
+      if (c == '\\' && *text)
+        c = *text++;
+      token->op = GLOB_LITERAL;
+      token->literal = c;
+    }
+  }
+}
+
+void glob_pattern_free(struct glob_pattern *pattern) {
+  free(pattern->tokens);
+  free(pattern->literal);
+}
+
+/**
+ * Match a name against a compiled component, backtracking only to the last
+ * star seen
+ */
+bool glob_match(struct glob_pattern *pattern, const char *name) {
+  if (name[0] == '.' && !pattern->dot_ok)
+    return false;
+  int t = 0, star = -1;
+  const char *s = name, *star_s = NULL;
+  while (*s) {
+    if (t < pattern->count) {
+      struct glob_token *token = &pattern->tokens[t];
+      unsigned char c = *s;
+      bool ok = false;
+      if (token->op == GLOB_STAR) {
+        star = t++;
+        star_s = s;
+        continue;
+      }
+      if (token->op == GLOB_ANY)
+        ok = true;
+      else if (token->op == GLOB_LITERAL)
+        ok = token->literal == (char)c;
+      else
+        ok = ((token->set[c >> 3] >> (c & 7)) & 1) != token->negate;
+      if (ok) {
+        t++;
+        s++;
+        continue;
+      }
+    }
+    if (star == -1)
+      return false;
+    t = star + 1; // let the star swallow one more byte
+    s = ++star_s;
+  }
+  while (t < pattern->count && pattern->tokens[t].op == GLOB_STAR)
+    t++;
+  return t == pattern->count;
+}
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct glob_item {
+  char *dir; // "" for the working directory
+  int index; // component to match inside dir
+};
+
+struct glob_worker {
+  struct arena arena;
+  char **results;
+  size_t count, capacity;
+};
+
+struct glob_walk {
+  struct glob_pattern *components;
+  int component_count;
+  bool dirs_only; // pattern ends in '/'
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct glob_item *queue;
+  size_t queued, queue_capacity;
+  int active; // workers in the middle of an item
+};
+
+char *glob_join(struct glob_worker *worker, const char *dir,
+                const char *name) {
+  size_t dir_len = strlen(dir), name_len = strlen(name);
+  bool slash = dir_len > 0 && dir[dir_len - 1] != '/';
+  char *path = arena_alloc(&worker->arena, dir_len + slash + name_len + 1);
+  memcpy(path, dir, dir_len);
+  if (slash)
+    path[dir_len] = '/';
+  memcpy(path + dir_len + slash, name, name_len + 1);
+  return path;
+}
+
+void glob_emit(struct glob_worker *worker, char *path) {
+  if (worker->count == worker->capacity) {
+    worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+    worker->results = (char **)realloc(worker->results,
+                                       worker->capacity * sizeof(char *));
+  }
+  worker->results[worker->count++] = path;
+}
+
+void glob_push(struct glob_walk *walk, char *dir, int index) {
+  pthread_mutex_lock(&walk->lock);
+  if (walk->queued == walk->queue_capacity) {
+    walk->queue_capacity = walk->queue_capacity ? walk->queue_capacity * 2 : 64;
+    walk->queue = (struct glob_item *)realloc(
+        walk->queue, walk->queue_capacity * sizeof(struct glob_item));
+  }
+  walk->queue[walk->queued].dir = dir;
+  walk->queue[walk->queued++].index = index;
+  pthread_cond_signal(&walk->ready);
+  pthread_mutex_unlock(&walk->lock);
+}
+
+/**
+ * Whether a directory entry leads to a directory
+ * @param follow also accept symlinks to directories
+ */
+bool glob_is_dir(int dir_fd, struct linux_dirent64 *ent, bool follow) {
+  struct stat st;
+  if (ent->d_type == DT_DIR)
+    return true;
+  if (ent->d_type == DT_LNK && !follow)
+    return false;
+  if (ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN)
+    return false;
+  return fstatat(dir_fd, ent->d_name, &st,
+                 follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+         S_ISDIR(st.st_mode);
+}
+
+/**
+ * Match one component inside one directory, queueing deeper work
+ */
+void glob_visit(struct glob_walk *walk, struct glob_worker *worker,
+                struct glob_item item) {
+  struct glob_pattern *pattern = &walk->components[item.index];
+  bool last = item.index == walk->component_count - 1;
+
+  // plain components need no listing at all
+  if (pattern->literal) {
+    char *path = glob_join(worker, item.dir, pattern->literal);
+    struct stat st;
+    if (last && walk->dirs_only) {
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        glob_emit(worker, glob_join(worker, path, ""));
+    } else if (last) {
+      if (lstat(path, &st) == 0)
+        glob_emit(worker, path);
+    } else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+      glob_push(walk, path, item.index + 1);
+    return;
+  }
+  // "**" matches zero directories too
+  if (pattern->recursive && !last)
+    glob_push(walk, item.dir, item.index + 1);
+
+  int dir_fd = open(item.dir[0] ? item.dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return;
+  char buffer[32768];
+  long n;
+  while ((n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0) {
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 *ent = (struct linux_dirent64 *)(buffer + off);
+      off += ent->d_reclen;
+      char *name = ent->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      if (pattern->recursive) {
+        if (name[0] == '.')
+          continue;
+        char *path = glob_join(worker, item.dir, name);
+        bool is_dir = glob_is_dir(dir_fd, ent, false);
+        if (last && (!walk->dirs_only || is_dir))
+          glob_emit(worker, walk->dirs_only ? glob_join(worker, path, "")
+                                            : path);
+        if (is_dir) // symlinks are not descended
+          glob_push(walk, path, item.index);
+        continue;
+      }
+      if (!glob_match(pattern, name))
+        continue;
+      if (last && walk->dirs_only) {
+        if (glob_is_dir(dir_fd, ent, true))
+          glob_emit(worker, glob_join(worker,
+                                      glob_join(worker, item.dir, name), ""));
+      } else if (last)
+        glob_emit(worker, glob_join(worker, item.dir, name));
+      else if (glob_is_dir(dir_fd, ent, true))
+        glob_push(walk, glob_join(worker, item.dir, name), item.index + 1);
+    }
+  }
+  close(dir_fd);
+}
+
+struct glob_thread {
+  struct glob_walk *walk;
+  struct glob_worker worker;
+  pthread_t thread;
+};
+
+void *glob_worker_main(void *arg) {
+  struct glob_thread *self = (struct glob_thread *)arg;
+  struct glob_walk *walk = self->walk;
+  pthread_mutex_lock(&walk->lock);
+  while (1) {
+    while (walk->queued == 0 && walk->active > 0)
+      pthread_cond_wait(&walk->ready, &walk->lock);
+    if (walk->queued == 0) { // nothing queued and nobody can queue more
+      pthread_cond_broadcast(&walk->ready);
+      break;
+    }
+    struct glob_item item = walk->queue[--walk->queued];
+    walk->active++;
+    pthread_mutex_unlock(&walk->lock);
+    glob_visit(walk, &self->worker, item);
+    pthread_mutex_lock(&walk->lock);
+    walk->active--;
+  }
+  pthread_mutex_unlock(&walk->lock);
+  return NULL;
+}
+
+int glob_path_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Expand a glob pattern
+ * @param  arena   receives the storage of the expanded names
+ * @param  results set to a sorted array of names, freed by the caller
+ * @return         number of names, 0 when nothing matched
+ */
+size_t glob_expand(const char *text, struct arena *arena, char ***results) {
+  struct glob_walk walk;
+  memset(&walk, 0, sizeof(walk));
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.ready, NULL);
+
+  char *copy = strdup(text), *save, *part;
+  walk.dirs_only = text[0] && text[strlen(text) - 1] == '/';
+  walk.components = (struct glob_pattern *)calloc(strlen(text) / 2 + 2,
+                                                  sizeof(struct glob_pattern));
+  bool recursive = false;
+  for (part = strtok_r(copy, "/", &save); part;
+       part = strtok_r(NULL, "/", &save)) {
+    glob_compile(part, &walk.components[walk.component_count]);
+    recursive |= walk.components[walk.component_count++].recursive;
+  }
+  free(copy);
+
+  *results = NULL;
+  if (walk.component_count == 0) {
+    free(walk.components);
+    return 0;
+  }
+  glob_push(&walk, (char *)(text[0] == '/' ? "/" : ""), 0);
+
+  // a flat pattern is one directory listing, only "**" pays for threads
+  int threads = 1;
+  if (recursive) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < 1 ? 1 : threads > 8 ? 8 : threads;
+  }
+  struct glob_thread *pool =
+      (struct glob_thread *)calloc(threads, sizeof(struct glob_thread));
+  for (int i = 0; i < threads; i++) {
+    pool[i].walk = &walk;
+    if (i > 0)
+      pthread_create(&pool[i].thread, NULL, glob_worker_main, &pool[i]);
+  }
+  glob_worker_main(&pool[0]);
+
+  size_t total = 0;
+  for (int i = 0; i < threads; i++) {
+    if (i > 0)
+      pthread_join(pool[i].thread, NULL);
+    total += pool[i].worker.count;
+  }
+  if (total > 0)
+    *results = (char **)malloc(total * sizeof(char *));
+  total = 0;
+  for (int i = 0; i < threads; i++) {
+    if (pool[i].worker.count)
+      memcpy(*results + total, pool[i].worker.results,
+             pool[i].worker.count * sizeof(char *));
+    total += pool[i].worker.count;
+    free(pool[i].worker.results);
+    arena_merge(arena, &pool[i].worker.arena);
+  }
+  qsort(*results, total, sizeof(char *), glob_path_cmp);
+
+  for (int i = 0; i < walk.component_count; i++)
+    glob_pattern_free(&walk.components[i]);
+  free(walk.components);
+  free(walk.queue);
+  free(pool);
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.ready);
+  return total;
+}
+
+// Command substitutions of the line being parsed, see mark_substitutions
+#define SUBST_MARK '\x01'
+#define SUBST_MAX 128
+
+struct substitutions {
+  char *bodies[SUBST_MAX];
+  int count;
+};
+
+struct substitutions *line_substitutions = NULL;
+
+char **substitution_words(struct command_t *command, const char *token,
+                          bool split, size_t *count);
+int parse_line(char *buf, struct command_t *command);
+
+/**
+ * Append one argument word to a command, globbing it unless it was quoted.
+ * Backslashes of an unquoted word are removed once it is kept literally.
+ * A word that already lives in the command's arena, e.g. one split out of
+ * a substitution's output, is kept where it is instead of being copied.
+ */
+void parse_add_arg(struct command_t *command, const char *arg, bool quoted,
+                   int *arg_index, int *arg_capacity) {
+  // glob: matches replace the pattern, no match keeps it literally
+  char **matches = NULL;
+  size_t match_count = 0;
+  if (!quoted && glob_has_magic(arg)) {
+    if (!command->arena)
+      command->arena = (struct arena *)calloc(1, sizeof(struct arena));
+    match_count = glob_expand(arg, command->arena, &matches);
+  }
+  if (*arg_index + (int)match_count + 1 > *arg_capacity) {
+    while (*arg_index + (int)match_count + 1 > *arg_capacity)
+      *arg_capacity *= 2;
+    command->args =
+        (char **)realloc(command->args, sizeof(char *) * *arg_capacity);
+  }
+  if (match_count) {
+    memcpy(command->args + *arg_index, matches, match_count * sizeof(char *));
+    *arg_index += match_count;
+    free(matches);
+    return;
+  }
+  if (arena_owns(command->arena, arg)) {
+    command->args[(*arg_index)++] = (char *)arg;
+    return;
+  }
+  char *word = strdup(arg);
+  if (!quoted)
+    glob_unquote(word);
+  command->args[(*arg_index)++] = word;
+}
+
 /**
  * Parse a command string into a command struct
  * @param  buf     [description]
@@ -102,34 +665,55 @@ int parse_command(char *buf, struct command_t *command) {
   }
   while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
     buf[--len] = 0; // trim right whitespace
+  char *line_end = buf + len;
 
   if (len > 0 && buf[len - 1] == '?') // auto-complete
     command->auto_complete = true;
   if (len > 0 && buf[len - 1] == '&') // background
     command->background = true;
 
-  char *pch = strtok(buf, splitters);
+  char *save; // strtok_r: substitutions parse nested lines mid-way
+  char *pch = strtok_r(buf, splitters, &save);
+  char *pending = NULL; // token to handle before asking strtok again
+  if (pch != NULL && (pch[0] == '<' || pch[0] == '>')) {
+    pending = pch; // a line made of redirections only, e.g. "<in >out"
+    pch = NULL;
+  }
+  char **lead = NULL; // words after the first one of a substituted name
+  size_t lead_count = 0;
+  if (pch != NULL && strchr(pch, SUBST_MARK)) {
+    lead = substitution_words(command, pch, true, &lead_count);
+    pch = lead_count ? lead[0] : NULL;
+  }
   if (pch == NULL) {
     command->name = (char *)malloc(1);
     command->name[0] = 0;
   } else {
     command->name = (char *)malloc(strlen(pch) + 1);
     strcpy(command->name, pch);
+    if (!lead)
+      glob_unquote(command->name);
   }
 
   command->args = (char **)malloc(sizeof(char *));
 
   int redirect_index;
   int arg_index = 0;
-  char temp_buf[1024], *arg;
+  int arg_capacity = 1;
+  char *arg;
+  for (size_t i = 1; i < lead_count; i++)
+    parse_add_arg(command, lead[i], false, &arg_index, &arg_capacity);
+  free(lead);
   while (1) {
     // tokenize input on splitters
-    pch = strtok(NULL, splitters);
+    pch = pending ? pending : strtok_r(NULL, splitters, &save);
+    pending = NULL;
     if (!pch)
       break;
-    arg = temp_buf;
-    strcpy(arg, pch);
+    arg = pch; // edited in place, the argument itself is copied below
     len = strlen(arg);
+    // the word being completed ends in '?', it is a prefix and not a glob
+    bool completing = command->auto_complete && arg + len == line_end;
 
     if (len == 0)
       continue; // empty arg, go for next
@@ -146,7 +730,7 @@ int parse_command(char *buf, struct command_t *command) {
     // piping to another command
     if (strcmp(arg, "|") == 0) {
       struct command_t *c =
-          (struct command_t *)malloc(sizeof(struct command_t));
+          (struct command_t *)calloc(1, sizeof(struct command_t));
       int l = strlen(pch);
       pch[l] = splitters[0]; // restore strtok termination
       index = 1;
@@ -156,7 +740,7 @@ int parse_command(char *buf, struct command_t *command) {
       parse_command(pch + index, c);
       pch[l] = 0; // put back strtok termination
       command->next = c;
-      continue;
+      break; // the rest of the line belongs to the next command
     }
 
     // background process
@@ -176,23 +760,43 @@ int parse_command(char *buf, struct command_t *command) {
         redirect_index = 1;
     }
     if (redirect_index != -1) {
-      command->redirects[redirect_index] = (char *)malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
+      char *file = arg + 1;
+      if (*file == '\0') // file name given as the next token, e.g. "> out"
+        file = strtok_r(NULL, splitters, &save);
+      if (!file)
+        continue;
+      free(command->redirects[redirect_index]);
+      if (strchr(file, SUBST_MARK)) {
+        size_t count;
+        char **words = substitution_words(command, file, false, &count);
+        command->redirects[redirect_index] = strdup(words[0]);
+        free(words);
+      } else
+        command->redirects[redirect_index] = strdup(file);
       continue;
     }
 
     // normal arguments
+    bool quoted = false;
     if (len > 2 &&
         ((arg[0] == '"' && arg[len - 1] == '"') ||
          (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
     {
       arg[--len] = 0;
       arg++;
+      quoted = true;
     }
-    command->args =
-        (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
+
+    if (strchr(arg, SUBST_MARK)) {
+      size_t count;
+      char **words = substitution_words(command, arg, !quoted, &count);
+      for (size_t i = 0; i < count; i++)
+        parse_add_arg(command, words[i], quoted, &arg_index, &arg_capacity);
+      free(words);
+      continue;
+    }
+    parse_add_arg(command, arg, quoted || completing, &arg_index,
+                  &arg_capacity);
   }
   command->arg_count = arg_index;
 
@@ -266,12 +870,12 @@ int prompt(struct command_t *command) {
       continue;
     }
 
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
-      continue;
-    }
+    // arrow keys arrive as ESC [ A..D; '[' and A-D on their own are text
+    if (c == 27) {
+      if (getchar() != 91 || getchar() != 65) // only up arrow is handled
+        continue;
 
-    if (c == 65) // up arrow
-    {
+      // up arrow
       while (index > 0) {
         prompt_backspace();
         index--;
@@ -301,7 +905,7 @@ int prompt(struct command_t *command) {
 
   strcpy(oldbuf, buf);
 
-  parse_command(buf, command);
+  parse_line(buf, command);
 
   // print_command(command); // DEBUG: uncomment for debugging
 
@@ -310,186 +914,771 @@ int prompt(struct command_t *command) {
   return SUCCESS;
 }
 
-// Part3-b Chatroom
+// Chatroom scrollback
+// Every message is appended to a per-room log in /tmp/chatroom-<room>/
+// .scrollback, one framed record per O_APPEND write. Segments rotate by size
+// and each one has a sparse index of (offset, time) pairs, so a joining user
+// gets "the last N messages" or "messages since T" by mapping the newest
+// segments and jumping through the index instead of scanning everything.
 
-void run_chatroom(char *roomname, char *username) {
-  char room_path[256], my_pipe[256], buffer[1024], formatted_msg[1200];
+#define CHATLOG_MAGIC 0x474c4853 // "SHLG"
+#define CHATLOG_SEGMENT_MAX (1 << 20)
+#define CHATLOG_KEEP 8          // segments kept on disk
+#define CHATLOG_INDEX_EVERY 4096 // one index entry per this many log bytes
 
-  // Create room folder and user pipe 
-  strcpy(room_path, "/tmp/chatroom-");
-  strcat(room_path, roomname);
-  mkdir(room_path, 0777); 
+bool write_all(int fd, const char *data, size_t len);
 
-  strcpy(my_pipe, room_path);
-  strcat(my_pipe, "/");
-  strcat(my_pipe, username);
-  mkfifo(my_pipe, 0666);
+struct chatlog_record {
+  uint32_t magic;
+  uint32_t len; // payload bytes following the header
+  int64_t time_ms;
+};
 
-  printf("Welcome to %s!\n", roomname);
+struct chatlog_index {
+  uint64_t offset;
+  int64_t time_ms;
+};
 
-  // RECEIVER: Continuous reading 
-  if (fork() == 0) {
-    while (1) {
-      int fd = open(my_pipe, O_RDONLY);
-      if (fd != -1) {
-        int n = read(fd, buffer, sizeof(buffer));
-        if (n > 0) {
-          // Write the received message and refresh prompt using low-level write 
-          write(STDOUT_FILENO, "\r", 1);
-          write(STDOUT_FILENO, buffer, n);
-          write(STDOUT_FILENO, "\n", 1);
-                    
-          char prompt[512];
-          strcpy(prompt, "[");
-          strcat(prompt, roomname);
-          strcat(prompt, "] ");
-          strcat(prompt, username);
-          strcat(prompt, " > ");
-          write(STDOUT_FILENO, prompt, strlen(prompt));
-        }
-        close(fd);
-      }
-    }
-  }
+struct chatlog {
+  int dir_fd;
+  unsigned segment;
+  int log_fd;
+  int index_fd;
+};
 
-  // SENDER: Iterate directory using 'exec' 
-  while (1) {
-    printf("[%s] %s > ", roomname, username);
-    if (fgets(buffer, sizeof(buffer), stdin) == NULL) break;
-      buffer[strcspn(buffer, "\n")] = 0;
+struct chatlog_segment {
+  char *data;
+  size_t size;
+  struct chatlog_index *index;
+  size_t index_count;
+};
 
-    if (strlen(buffer) == 0) continue;
+int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-      strcpy(formatted_msg, "[");
-      strcat(formatted_msg, roomname);
-      strcat(formatted_msg, "] ");
-      strcat(formatted_msg, username);
-      strcat(formatted_msg, ": ");
-      strcat(formatted_msg, buffer);
+/**
+ * Find the oldest and newest segment numbers of a log
+ * @return false when the log has no segments yet
+ */
+bool chatlog_segments(int dir_fd, unsigned *oldest, unsigned *newest) {
+  DIR *d = fdopendir(dup(dir_fd));
+  if (!d)
+    return false;
+  rewinddir(d); // the duplicate shares its offset with earlier scans
+  bool found = false;
+  struct dirent *ent;
+  unsigned seg;
+  char tail[8];
+  while ((ent = readdir(d)) != NULL) {
+    if (sscanf(ent->d_name, "seg-%8u.%3s", &seg, tail) != 2 ||
+        strcmp(tail, "log") != 0)
+      continue;
+    if (!found || seg < *oldest)
+      *oldest = seg;
+    if (!found || seg > *newest)
+      *newest = seg;
+    found = true;
+  }
+  closedir(d);
+  return found;
+}
 
-      // Directory Traversal using exec(ls) and a pipe 
-      int p[2];
-      pipe(p);
+bool chatlog_open_segment(struct chatlog *log, unsigned segment) {
+  char name[32];
+  if (log->log_fd != -1)
+    close(log->log_fd);
+  if (log->index_fd != -1)
+    close(log->index_fd);
+  snprintf(name, sizeof(name), "seg-%08u.log", segment);
+  log->log_fd = openat(log->dir_fd, name,
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  snprintf(name, sizeof(name), "seg-%08u.idx", segment);
+  log->index_fd = openat(log->dir_fd, name,
+                         O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  log->segment = segment;
+  if (segment >= CHATLOG_KEEP) { // retire the segment that fell out
+    snprintf(name, sizeof(name), "seg-%08u.log", segment - CHATLOG_KEEP);
+    unlinkat(log->dir_fd, name, 0);
+    snprintf(name, sizeof(name), "seg-%08u.idx", segment - CHATLOG_KEEP);
+    unlinkat(log->dir_fd, name, 0);
+  }
+  return log->log_fd != -1 && log->index_fd != -1;
+}
 
-      if (fork() == 0) {
-        dup2(p[1], STDOUT_FILENO);
-        close(p[0]); 
-        close(p[1]);
-        execlp("ls", "ls", room_path, NULL);
-        exit(1);
-      }
+bool chatlog_open(struct chatlog *log, const char *room_path) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/.scrollback", room_path);
+  mkdir(path, 0777);
+  log->log_fd = log->index_fd = -1;
+  log->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (log->dir_fd == -1)
+    return false;
+  unsigned oldest, newest = 0;
+  chatlog_segments(log->dir_fd, &oldest, &newest);
+  return chatlog_open_segment(log, newest);
+}
 
-      // Parent
-      close(p[1]);
-      char ls_buffer[4096];
-      int bytes_read = read(p[0], ls_buffer, sizeof(ls_buffer) - 1);
-        
-      if (bytes_read > 0) {
-        ls_buffer[bytes_read] = '\0';
-        char *target_user = strtok(ls_buffer, "\n");
-            
-        while (target_user != NULL) {
-          if (strcmp(target_user, username) == 0) {
-            target_user = strtok(NULL, "\n");
-            continue;
-          }
-          // Separate child for each user 
-          if (fork() == 0) {
-            char target_path[512];
-            strcpy(target_path, room_path);
-            strcat(target_path, "/");
-            strcat(target_path, target_user);
-
-            int fd_w = open(target_path, O_WRONLY | O_NONBLOCK);
-            if (fd_w != -1) {
-              write(fd_w, formatted_msg, strlen(formatted_msg));
-              close(fd_w);
-            }
-            exit(0);
-          }
-          target_user = strtok(NULL, "\n");
-        }
-    }
-    close(p[0]);
-    wait(NULL); 
-  }
+void chatlog_close(struct chatlog *log) {
+  if (log->log_fd != -1)
+    close(log->log_fd);
+  if (log->index_fd != -1)
+    close(log->index_fd);
+  if (log->dir_fd != -1)
+    close(log->dir_fd);
 }
 
-// Helper
-void print_board(char board[10][10], char *title) {
-  char header[128];
-  sprintf(header, "\n--- %s ---\n    A B C D E F G H I J\n", title);
-  write(STDOUT_FILENO, header, strlen(header));
-  write(STDOUT_FILENO, "   --------------------\n", 24);
+/**
+ * Append one message as a single framed record
+ */
+void chatlog_append(struct chatlog *log, const char *msg, size_t len) {
+  if (log->log_fd == -1)
+    return;
+  // someone (maybe us) filled the segment: move to the next one
+  struct stat st;
+  while (fstat(log->log_fd, &st) == 0 && st.st_size >= CHATLOG_SEGMENT_MAX)
+    if (!chatlog_open_segment(log, log->segment + 1))
+      return;
 
-  for (int i = 0; i < 10; i++) {
-    char row_num[10];
-    sprintf(row_num, "%2d |", i + 1);
-    write(STDOUT_FILENO, row_num, strlen(row_num));
-    for (int j = 0; j < 10; j++) {
-      write(STDOUT_FILENO, &board[i][j], 1);
-      write(STDOUT_FILENO, " ", 1);
-    }
-    write(STDOUT_FILENO, "\n", 1);
+  size_t total = sizeof(struct chatlog_record) + len;
+  char *frame = (char *)malloc(total);
+  struct chatlog_record header = {CHATLOG_MAGIC, (uint32_t)len, now_ms()};
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), msg, len);
+  ssize_t n = write(log->log_fd, frame, total);
+  free(frame);
+  if (n != (ssize_t)total)
+    return;
+
+  // with O_APPEND the file position now sits right after our record
+  off_t end = lseek(log->log_fd, 0, SEEK_CUR);
+  off_t start = end - total;
+  if (start == 0 || start / CHATLOG_INDEX_EVERY != end / CHATLOG_INDEX_EVERY) {
+    struct chatlog_index entry = {(uint64_t)start, header.time_ms};
+    write(log->index_fd, &entry, sizeof(entry));
   }
-  write(STDOUT_FILENO, "\n", 1);
 }
 
-// Helper for battleship
-void send_to_other(char *room_path, char *my_name, char *msg) {
-  int p[2];
-  // Create anonymous pipe 
-  if (pipe(p) == -1) return;
+int chatlog_index_cmp(const void *a, const void *b) {
+  uint64_t x = ((const struct chatlog_index *)a)->offset;
+  uint64_t y = ((const struct chatlog_index *)b)->offset;
+  return x < y ? -1 : x > y;
+}
 
-  // Child process: execute "ls" to list all users
-  if (fork() == 0) {
-    dup2(p[1], STDOUT_FILENO);
-    close(p[0]);
-    close(p[1]);
-    execlp("ls", "ls", room_path, NULL);
-    exit(1);
+bool chatlog_map(int dir_fd, unsigned segment, struct chatlog_segment *seg) {
+  char name[32];
+  struct stat st;
+  memset(seg, 0, sizeof(*seg));
+  snprintf(name, sizeof(name), "seg-%08u.log", segment);
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    seg->data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (seg->data == MAP_FAILED)
+      seg->data = NULL;
+    else
+      seg->size = st.st_size;
   }
-  // Parent process reads the output of "ls"
-  close(p[1]);
-  char ls_buf[1024];
-  int n = read(p[0], ls_buf, sizeof(ls_buf) - 1);
-  close(p[0]);
+  close(fd);
 
-  if (n > 0) {
-    ls_buf[n] = '\0';
-    char *user = strtok(ls_buf, "\n");
-    while (user != NULL) {
-    // We dont send ourselves a message
-      if (strcmp(user, my_name) != 0) {
-        if (fork() == 0) {
-          char target_path[512];
-          sprintf(target_path, "%s/%s", room_path, user);
-          int fd = open(target_path, O_WRONLY | O_NONBLOCK);
-          if (fd != -1) {
-            write(fd, msg, strlen(msg) + 1);
-            close(fd);
-          }
-          exit(0);
-        }
-      }
-      user = strtok(NULL, "\n");
-    }
+  snprintf(name, sizeof(name), "seg-%08u.idx", segment);
+  fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    seg->index = (struct chatlog_index *)malloc(st.st_size);
+    ssize_t n = read(fd, seg->index, st.st_size);
+    seg->index_count = n > 0 ? n / sizeof(struct chatlog_index) : 0;
+    // concurrent writers may have appended entries slightly out of order
+    qsort(seg->index, seg->index_count, sizeof(struct chatlog_index),
+          chatlog_index_cmp);
   }
-  // Wait for children
-  while (waitpid(-1, NULL, WNOHANG) > 0);
+  if (fd != -1)
+    close(fd);
+  return true; // an empty segment maps to no data
 }
 
-//Helper ship placer for Battle Ship
-void place_ship(char board[10][10], char *coord_str) {
-  char c1_c, c2_c; // Starting and ending column letters (A–J)
-  int r1, r2; // Starting and ending row numbers (1–10)
-  if (sscanf(coord_str, " %c%d:%c%d", &c1_c, &r1, &c2_c, &r2) == 4) {
-    int start_row = r1 - 1;
-    int end_row = r2 - 1;
-    int start_col = toupper(c1_c) - 'A';
-    int end_col = toupper(c2_c) - 'A';
+void chatlog_unmap(struct chatlog_segment *seg) {
+  if (seg->data)
+    munmap(seg->data, seg->size);
+  free(seg->index);
+}
 
-    // Mark S which means ship
+/**
+ * Record at an offset, NULL past the end or at a torn/corrupt record
+ */
+struct chatlog_record *chatlog_at(struct chatlog_segment *seg, size_t off) {
+  if (off + sizeof(struct chatlog_record) > seg->size)
+    return NULL;
+  struct chatlog_record *rec = (struct chatlog_record *)(seg->data + off);
+  if (rec->magic != CHATLOG_MAGIC ||
+      off + sizeof(*rec) + rec->len > seg->size)
+    return NULL;
+  return rec;
+}
+
+size_t chatlog_count(struct chatlog_segment *seg, size_t from, size_t to) {
+  size_t count = 0;
+  struct chatlog_record *rec;
+  while (from < to && (rec = chatlog_at(seg, from)) != NULL) {
+    count++;
+    from += sizeof(*rec) + rec->len;
+  }
+  return count;
+}
+
+/**
+ * Offset of the first of the last n records of a segment
+ * @param found set to how many records that start offset covers
+ */
+size_t chatlog_tail_start(struct chatlog_segment *seg, size_t n,
+                          size_t *found) {
+  // walk the index backwards, counting only the stretches we need
+  size_t to = seg->size, total = 0, from = 0;
+  for (size_t k = seg->index_count; k > 0 && total < n; k--) {
+    from = seg->index[k - 1].offset;
+    total += chatlog_count(seg, from, to);
+    to = from;
+  }
+  if (total < n && to > 0) { // records before the first index entry
+    total += chatlog_count(seg, 0, to);
+    from = 0;
+  }
+  // skip the surplus at the front of the stretch we landed in
+  for (; total > n; total--) {
+    struct chatlog_record *rec = chatlog_at(seg, from);
+    from += sizeof(*rec) + rec->len;
+  }
+  *found = total;
+  return from;
+}
+
+/**
+ * Offset of the first record written at or after a time
+ */
+size_t chatlog_since_start(struct chatlog_segment *seg, int64_t since_ms) {
+  size_t lo = 0, hi = seg->index_count, from = 0;
+  while (lo < hi) { // last index entry older than since_ms
+    size_t mid = (lo + hi) / 2;
+    if (seg->index[mid].time_ms < since_ms) {
+      from = seg->index[mid].offset;
+      lo = mid + 1;
+    } else
+      hi = mid;
+  }
+  struct chatlog_record *rec;
+  while ((rec = chatlog_at(seg, from)) != NULL && rec->time_ms < since_ms)
+    from += sizeof(*rec) + rec->len;
+  return from;
+}
+
+void chatlog_emit(struct chatlog_segment *seg, size_t from, char **out,
+                  size_t *len, size_t *cap) {
+  struct chatlog_record *rec;
+  while ((rec = chatlog_at(seg, from)) != NULL) {
+    if (*len + rec->len + 1 > *cap) {
+      *cap = (*len + rec->len + 1) * 2;
+      *out = (char *)realloc(*out, *cap);
+    }
+    memcpy(*out + *len, (char *)(rec + 1), rec->len);
+    *len += rec->len;
+    (*out)[(*len)++] = '\n';
+    from += sizeof(*rec) + rec->len;
+  }
+}
+
+/**
+ * Print scrollback for a joining user
+ * @param last_n   print the last n messages (used when since_ms is 0)
+ * @param since_ms print messages written at or after this time
+ */
+void chatlog_replay(struct chatlog *log, size_t last_n, int64_t since_ms) {
+  unsigned oldest, newest;
+  if (log->dir_fd == -1 || (since_ms == 0 && last_n == 0) ||
+      !chatlog_segments(log->dir_fd, &oldest, &newest))
+    return;
+
+  // pick start points from the newest segment backwards
+  unsigned count = newest - oldest + 1;
+  struct chatlog_segment *segs = (struct chatlog_segment *)calloc(
+      count, sizeof(struct chatlog_segment));
+  size_t *starts = (size_t *)calloc(count, sizeof(size_t));
+  unsigned first = count;
+  size_t wanted = last_n;
+  while (first > 0) {
+    unsigned i = first - 1;
+    if (!chatlog_map(log->dir_fd, oldest + i, &segs[i]))
+      break;
+    first = i;
+    if (since_ms) {
+      // older segments only matter while this one is newer than since_ms
+      starts[i] = chatlog_since_start(&segs[i], since_ms);
+      struct chatlog_record *rec = chatlog_at(&segs[i], 0);
+      if (rec && rec->time_ms < since_ms)
+        break;
+    } else {
+      size_t found;
+      starts[i] = chatlog_tail_start(&segs[i], wanted, &found);
+      wanted -= found;
+      if (wanted == 0)
+        break;
+    }
+  }
+
+  char *out = NULL;
+  size_t len = 0, cap = 0;
+  for (unsigned i = first; i < count; i++)
+    chatlog_emit(&segs[i], starts[i], &out, &len, &cap);
+  if (len) {
+    write_all(STDOUT_FILENO, "--- earlier messages ---\n", 25);
+    write_all(STDOUT_FILENO, out, len);
+    write_all(STDOUT_FILENO, "------------------------\n", 25);
+  }
+  for (unsigned i = 0; i < count; i++)
+    chatlog_unmap(&segs[i]);
+  free(out);
+  free(segs);
+  free(starts);
+}
+
+// Chatroom presence
+// Every room keeps a table of its members in a hidden file next to the user
+// FIFOs. Members hold a lease that a heartbeat thread renews; a member whose
+// lease ran out or whose process is gone is dropped together with its FIFO,
+// so senders only ever open the FIFOs of people who are still there. A
+// member that was only stalled, e.g. stopped with Ctrl+Z, registers again
+// on its next heartbeat.
+#define PRESENCE_SLOTS 128
+#define PRESENCE_LEASE_MS 15000 // a member vanishes this long after its last heartbeat
+
+struct presence_slot {
+  char name[64];
+  pid_t pid; // 0 for a free slot
+  int64_t expires_ms;
+};
+
+struct presence {
+  int fd;
+  struct presence_slot *slots; // the shared table, mapped from the file
+  char room_path[512];
+  char name[64]; // ours, kept to register again after an eviction
+  int self; // our slot, -1 before joining
+  pthread_mutex_t lock; // flock does not exclude threads of one process
+  pthread_cond_t wake;
+  pthread_t heartbeat;
+  bool heartbeat_running;
+  bool stopping;
+};
+
+struct presence *room_presence = NULL; // room this process is a member of
+pid_t room_receiver = 0; // its FIFO reader, killed when we leave
+
+/**
+ * Open and map the presence table of a room
+ * @return false when the table cannot be used
+ */
+bool presence_open(struct presence *p, const char *room_path) {
+  char path[600];
+  size_t size = PRESENCE_SLOTS * sizeof(struct presence_slot);
+  memset(p, 0, sizeof(*p));
+  p->self = -1;
+  snprintf(p->room_path, sizeof(p->room_path), "%s", room_path);
+  snprintf(path, sizeof(path), "%s/.presence", room_path);
+  p->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (p->fd == -1)
+    return false;
+  // Growing the file is idempotent, so racing joiners need no lock here
+  struct stat st;
+  if (fstat(p->fd, &st) == -1 ||
+      ((size_t)st.st_size < size && ftruncate(p->fd, size) == -1)) {
+    close(p->fd);
+    return false;
+  }
+  p->slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+  if (p->slots == MAP_FAILED) {
+    close(p->fd);
+    return false;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  return true;
+}
+
+/**
+ * Give a forked child its own view of the table. The child shares the
+ * parent's open file description, which would make flock a no-op between
+ * the two, and may have inherited a locked mutex from the heartbeat thread.
+ */
+bool presence_reopen(struct presence *p) {
+  int self = p->self;
+  char room_path[512];
+  munmap(p->slots, PRESENCE_SLOTS * sizeof(struct presence_slot));
+  close(p->fd);
+  memcpy(room_path, p->room_path, sizeof(room_path));
+  if (!presence_open(p, room_path))
+    return false;
+  p->self = self;
+  return true;
+}
+
+void presence_lock(struct presence *p) {
+  pthread_mutex_lock(&p->lock);
+  while (flock(p->fd, LOCK_EX) == -1 && errno == EINTR)
+    ;
+}
+
+void presence_unlock(struct presence *p) {
+  flock(p->fd, LOCK_UN);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Drop members whose lease expired or whose process is gone, unlinking
+ * their FIFOs. Called with the table locked.
+ */
+void presence_sweep(struct presence *p) {
+  int64_t now = now_ms();
+  for (int i = 0; i < PRESENCE_SLOTS; i++) {
+    struct presence_slot *slot = &p->slots[i];
+    if (slot->pid == 0 || i == p->self)
+      continue;
+    bool dead = kill(slot->pid, 0) == -1 && errno == ESRCH;
+    if (!dead && slot->expires_ms > now)
+      continue;
+    char fifo[600];
+    snprintf(fifo, sizeof(fifo), "%s/%.63s", p->room_path, slot->name);
+    unlink(fifo);
+    memset(slot, 0, sizeof(*slot));
+  }
+}
+
+/**
+ * Take the slot listing our name, or a free one, and make sure our FIFO
+ * exists. A name that is already listed is taken over, which is what a
+ * user reconnecting after a crash expects. Called with the table locked.
+ * @return false when the room is full
+ */
+bool presence_claim(struct presence *p) {
+  presence_sweep(p);
+  int slot = -1;
+  for (int i = 0; i < PRESENCE_SLOTS; i++) {
+    if (p->slots[i].pid != 0 && strcmp(p->slots[i].name, p->name) == 0) {
+      slot = i;
+      break;
+    }
+    if (p->slots[i].pid == 0 && slot == -1)
+      slot = i;
+  }
+  if (slot == -1)
+    return false;
+  memcpy(p->slots[slot].name, p->name, sizeof(p->name));
+  p->slots[slot].pid = getpid();
+  p->slots[slot].expires_ms = now_ms() + PRESENCE_LEASE_MS;
+  p->self = slot;
+  char fifo[600];
+  snprintf(fifo, sizeof(fifo), "%s/%s", p->room_path, p->name);
+  mkfifo(fifo, 0666); // gone if a sweep took our slot away
+  return true;
+}
+
+void *presence_heartbeat_main(void *arg) {
+  struct presence *p = arg;
+  pthread_mutex_lock(&p->lock);
+  while (!p->stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += PRESENCE_LEASE_MS / 3000;
+    pthread_cond_timedwait(&p->wake, &p->lock, &until);
+    if (p->stopping)
+      break;
+    flock(p->fd, LOCK_EX);
+    struct presence_slot *slot = &p->slots[p->self];
+    if (slot->pid == getpid())
+      slot->expires_ms = now_ms() + PRESENCE_LEASE_MS;
+    presence_sweep(p);
+    if (slot->pid != getpid()) // swept while we were stalled
+      presence_claim(p);
+    flock(p->fd, LOCK_UN);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/**
+ * Register a member and start renewing its lease
+ * @return false when the name does not fit a slot (ENAMETOOLONG) or the
+ *         room is full (EUSERS)
+ */
+bool presence_join(struct presence *p, const char *name) {
+  if (strlen(name) >= sizeof(p->name)) { // a cut name would miss its FIFO
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(p->name, name);
+  presence_lock(p);
+  bool joined = presence_claim(p);
+  presence_unlock(p);
+  if (!joined) {
+    errno = EUSERS;
+    return false;
+  }
+  p->heartbeat_running =
+      pthread_create(&p->heartbeat, NULL, presence_heartbeat_main, p) == 0;
+  return true;
+}
+
+/**
+ * Deliver a message to the FIFO of every live member except ourselves. The
+ * FIFOs are opened non-blocking, so a member without a reader is skipped
+ * instead of stalling the sender.
+ */
+void presence_broadcast(struct presence *p, const char *msg, size_t len) {
+  char names[PRESENCE_SLOTS][64];
+  int count = 0;
+  presence_lock(p);
+  presence_sweep(p);
+  for (int i = 0; i < PRESENCE_SLOTS; i++) {
+    if (p->slots[i].pid == 0 || i == p->self)
+      continue;
+    memcpy(names[count], p->slots[i].name, sizeof(names[count]));
+    names[count++][63] = '\0';
+  }
+  presence_unlock(p);
+
+  for (int i = 0; i < count; i++) {
+    char fifo[600];
+    snprintf(fifo, sizeof(fifo), "%s/%.63s", p->room_path, names[i]);
+    int fd = open(fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    write(fd, msg, len);
+    close(fd);
+  }
+}
+
+/**
+ * Leave the room: stop the heartbeat, free our slot, remove our FIFO and
+ * release the table
+ */
+void presence_leave(struct presence *p) {
+  if (p->heartbeat_running) {
+    pthread_mutex_lock(&p->lock);
+    p->stopping = true;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->heartbeat, NULL);
+    p->heartbeat_running = false;
+  }
+  if (p->self != -1) {
+    presence_lock(p);
+    struct presence_slot *slot = &p->slots[p->self];
+    if (slot->pid == getpid()) {
+      char fifo[600];
+      snprintf(fifo, sizeof(fifo), "%s/%.63s", p->room_path, slot->name);
+      unlink(fifo);
+      memset(slot, 0, sizeof(*slot));
+    }
+    presence_unlock(p);
+    p->self = -1;
+  }
+  munmap(p->slots, PRESENCE_SLOTS * sizeof(struct presence_slot));
+  close(p->fd);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+}
+
+/**
+ * Signal handler used while inside a room. Locks cannot be taken here, so
+ * the slot is cleared with plain stores; the signal is then re-raised with
+ * its default action.
+ */
+void presence_on_signal(int sig) {
+  struct presence *p = room_presence;
+  if (room_receiver > 0)
+    kill(room_receiver, SIGTERM);
+  if (p != NULL && p->self != -1 && p->slots[p->self].pid == getpid()) {
+    char fifo[600];
+    struct presence_slot *slot = &p->slots[p->self];
+    // Async-signal-safe path join, snprintf is not
+    size_t n = strlen(p->room_path);
+    memcpy(fifo, p->room_path, n);
+    fifo[n++] = '/';
+    memcpy(fifo + n, slot->name, 63);
+    fifo[n + 63] = '\0';
+    unlink(fifo);
+    slot->pid = 0;
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+ * Enter a room: join its presence table and clean up on SIGINT, SIGTERM
+ * and SIGHUP until room_exit is called
+ * @return false when the room cannot be joined
+ */
+bool room_enter(struct presence *p, const char *room_path, const char *name,
+                struct sigaction saved[3]) {
+  if (!presence_open(p, room_path))
+    return false;
+  if (!presence_join(p, name)) {
+    int error = errno;
+    presence_leave(p);
+    errno = error;
+    return false;
+  }
+  room_presence = p;
+  room_receiver = 0;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = presence_on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &saved[0]);
+  sigaction(SIGTERM, &sa, &saved[1]);
+  sigaction(SIGHUP, &sa, &saved[2]);
+  return true;
+}
+
+/**
+ * Leave the room entered by room_enter, stopping its receiver process
+ */
+void room_exit(struct presence *p, struct sigaction saved[3]) {
+  if (room_receiver > 0) {
+    kill(room_receiver, SIGTERM);
+    waitpid(room_receiver, NULL, 0);
+  }
+  presence_leave(p);
+  room_presence = NULL;
+  room_receiver = 0;
+  sigaction(SIGINT, &saved[0], NULL);
+  sigaction(SIGTERM, &saved[1], NULL);
+  sigaction(SIGHUP, &saved[2], NULL);
+}
+
+// Part3-b Chatroom
+
+void run_chatroom(char *roomname, char *username, size_t last_n,
+                  int64_t since_ms) {
+  char room_path[256], my_pipe[256], buffer[1024], formatted_msg[1200];
+
+  // Create room folder and user pipe 
+  strcpy(room_path, "/tmp/chatroom-");
+  strcat(room_path, roomname);
+  mkdir(room_path, 0777); 
+
+  strcpy(my_pipe, room_path);
+  strcat(my_pipe, "/");
+  strcat(my_pipe, username);
+  mkfifo(my_pipe, 0666);
+
+  printf("Welcome to %s!\n", roomname);
+  fflush(stdout);
+
+  // Catch up on what was said before we joined
+  struct chatlog log;
+  chatlog_open(&log, room_path);
+  chatlog_replay(&log, last_n, since_ms);
+
+  struct presence members;
+  struct sigaction saved[3];
+  if (!room_enter(&members, room_path, username, saved)) {
+    printf("-%s: %s: cannot join room: %s\n", sysname, roomname,
+           strerror(errno));
+    unlink(my_pipe);
+    chatlog_close(&log);
+    return;
+  }
+
+  // RECEIVER: Continuous reading 
+  fflush(stdout);
+  room_receiver = fork();
+  if (room_receiver == 0) {
+    while (1) {
+      int fd = open(my_pipe, O_RDONLY);
+      if (fd != -1) {
+        int n = read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+          // Write the received message and refresh prompt using low-level write 
+          write(STDOUT_FILENO, "\r", 1);
+          write(STDOUT_FILENO, buffer, n);
+          write(STDOUT_FILENO, "\n", 1);
+                    
+          char prompt[512];
+          strcpy(prompt, "[");
+          strcat(prompt, roomname);
+          strcat(prompt, "] ");
+          strcat(prompt, username);
+          strcat(prompt, " > ");
+          write(STDOUT_FILENO, prompt, strlen(prompt));
+        }
+        close(fd);
+      } else
+        poll(NULL, 0, 100); // FIFO swept away, the heartbeat brings it back
+    }
+  }
+
+  // SENDER: deliver to the live members of the room
+  while (1) {
+    printf("[%s] %s > ", roomname, username);
+    if (fgets(buffer, sizeof(buffer), stdin) == NULL) break;
+      buffer[strcspn(buffer, "\n")] = 0;
+
+    if (strlen(buffer) == 0) continue;
+
+      strcpy(formatted_msg, "[");
+      strcat(formatted_msg, roomname);
+      strcat(formatted_msg, "] ");
+      strcat(formatted_msg, username);
+      strcat(formatted_msg, ": ");
+      strcat(formatted_msg, buffer);
+      chatlog_append(&log, formatted_msg, strlen(formatted_msg));
+      presence_broadcast(&members, formatted_msg, strlen(formatted_msg));
+  }
+  room_exit(&members, saved);
+  chatlog_close(&log);
+}
+
+// Helper
+void print_board(char board[10][10], char *title) {
+  char header[128];
+  sprintf(header, "\n--- %s ---\n    A B C D E F G H I J\n", title);
+  write(STDOUT_FILENO, header, strlen(header));
+  write(STDOUT_FILENO, "   --------------------\n", 24);
+
+  for (int i = 0; i < 10; i++) {
+    char row_num[10];
+    sprintf(row_num, "%2d |", i + 1);
+    write(STDOUT_FILENO, row_num, strlen(row_num));
+    for (int j = 0; j < 10; j++) {
+      write(STDOUT_FILENO, &board[i][j], 1);
+      write(STDOUT_FILENO, " ", 1);
+    }
+    write(STDOUT_FILENO, "\n", 1);
+  }
+  write(STDOUT_FILENO, "\n", 1);
+}
+
+// Helper for battleship
+void send_to_other(char *room_path, char *my_name, char *msg) {
+  (void)room_path;
+  (void)my_name;
+  // The room's member table already knows who we are and who is still there
+  if (room_presence != NULL)
+    presence_broadcast(room_presence, msg, strlen(msg) + 1);
+}
+
+//Helper ship placer for Battle Ship
+void place_ship(char board[10][10], char *coord_str) {
+  char c1_c, c2_c; // Starting and ending column letters (A–J)
+  int r1, r2; // Starting and ending row numbers (1–10)
+  if (sscanf(coord_str, " %c%d:%c%d", &c1_c, &r1, &c2_c, &r2) == 4) {
+    int start_row = r1 - 1;
+    int end_row = r2 - 1;
+    int start_col = toupper(c1_c) - 'A';
+    int end_col = toupper(c2_c) - 'A';
+
+    // Mark S which means ship
     for (int i = start_row; i <= end_row; i++) {
       for (int j = start_col; j <= end_col; j++) {
         if (i >= 0 && i < 10 && j >= 0 && j < 10) {
@@ -535,6 +1724,15 @@ void run_battleship(char *roomname, char *username) {
   sprintf(my_pipe, "%s/%s", room_path, username);
   mkfifo(my_pipe, 0666);
 
+  struct presence members;
+  struct sigaction saved[3];
+  if (!room_enter(&members, room_path, username, saved)) {
+    printf("-%s: %s: cannot join room: %s\n", sysname, roomname,
+           strerror(errno));
+    unlink(my_pipe);
+    return;
+  }
+
   const char *intro =
         "\n--- BATTLESHIP: CURLYBOI EDITION ---\n"
         "Instructions:\n"
@@ -560,10 +1758,15 @@ void run_battleship(char *roomname, char *username) {
       print_board(my_board, "MY FINAL BOARD");
 
       // Start receiver process
-      if (fork() == 0) {
+      room_receiver = fork();
+      if (room_receiver == 0) {
+        presence_reopen(room_presence);
         while (1) {
           int fd = open(my_pipe, O_RDONLY);
-          if (fd == -1) continue;
+          if (fd == -1) { // swept away, the heartbeat brings it back
+            poll(NULL, 0, 100);
+            continue;
+          }
 
           char rx_buf[2048];
           int n = read(fd, rx_buf, sizeof(rx_buf) - 1);
@@ -682,155 +1885,3752 @@ void run_battleship(char *roomname, char *username) {
       break;
     }
   }
+  room_exit(&members, saved);
 }
 void exec_with_path(struct command_t *command);// Helper function for exec written under process command
 
-int process_command(struct command_t *command) {
+int process_command(struct command_t *command);
+bool is_builtin(struct command_t *command);
+
+/**
+ * Convert a waitpid status into a shell exit code
+ * @param  status status filled by waitpid
+ * @return        exit code, 128+signal for killed children
+ */
+int exit_code_of(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
 
+/**
+ * Write a whole buffer, retrying on short writes and EINTR
+ * @return true when everything was written
+ */
+bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
 
-  // PIPE HANDLING 
-  if (command->next) {
+// PATH cache
+// Resolved program paths are remembered per name, so a warm shell finds a
+// program with one hash lookup instead of one failed execv per PATH entry.
+// The shell resolves before forking, so children inherit a filled cache.
+#define PATH_CACHE_SLOTS 512
 
-    int fd[2];
-    pipe(fd); // fd[0] = read end, fd[1] = write end
+struct path_cache_entry {
+  char *name;
+  char *path;
+};
 
-    pid_t pid1 = fork();
+struct path_cache_entry path_cache[PATH_CACHE_SLOTS];
+int path_cache_used = 0;
+char *path_cache_env = NULL; // PATH the cache was filled for
 
-    if (pid1 == 0) { // first child 
-      dup2(fd[1], STDOUT_FILENO); // Redirect stdout to pipe write end
-      close(fd[0]);
-      close(fd[1]);
+void path_cache_clear() {
+  for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+    free(path_cache[i].name);
+    free(path_cache[i].path);
+    path_cache[i].name = path_cache[i].path = NULL;
+  }
+  path_cache_used = 0;
+}
 
-      exec_with_path(command);   
-      exit(1);
-    }
-    pid_t pid2 = fork();
+struct path_cache_entry *path_cache_slot(const char *name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *s = name; *s; s++)
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  for (int probe = 0; probe < PATH_CACHE_SLOTS; probe++) {
+    struct path_cache_entry *entry = &path_cache[(h + probe) % PATH_CACHE_SLOTS];
+    if (entry->name == NULL || strcmp(entry->name, name) == 0)
+      return entry;
+  }
+  return NULL;
+}
 
-    if (pid2 == 0) { // second child 
-      dup2(fd[0], STDIN_FILENO); // Redirect stdin to pipe read end
-      close(fd[1]);
-      close(fd[0]);
+/**
+ * Find the program a command name refers to. An empty PATH entry, leading,
+ * trailing or between two colons, stands for the working directory; what
+ * is found there is not cached since it changes with cd.
+ * @param  name command name, used as is when it contains a '/'
+ * @return      full path owned by the cache (or, for a working directory
+ *              hit, by a buffer reused by the next call), NULL when not found
+ */
+const char *path_lookup(const char *name) {
+  if (strchr(name, '/'))
+    return name;
+  const char *env = getenv("PATH");
+  if (env == NULL)
+    env = "";
+  if (path_cache_env == NULL || strcmp(path_cache_env, env) != 0) {
+    path_cache_clear();
+    free(path_cache_env);
+    path_cache_env = strdup(env);
+  }
+  struct path_cache_entry *entry = path_cache_slot(name);
+  if (entry && entry->name)
+    return entry->path;
 
-      process_command(command->next); // Recursively call next
-      exit(0);
+  static char full_path[PATH_MAX];
+  for (const char *dir = env; *env;) {
+    size_t len = strcspn(dir, ":");
+    if (len)
+      snprintf(full_path, sizeof(full_path), "%.*s/%s", (int)len, dir, name);
+    else
+      snprintf(full_path, sizeof(full_path), "./%s", name);
+    struct stat st;
+    if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(full_path, X_OK) == 0) {
+      if (len == 0)
+        return full_path;
+      // Keep the table at most three quarters full so probes stay short
+      if (path_cache_used >= PATH_CACHE_SLOTS * 3 / 4) {
+        path_cache_clear();
+        entry = path_cache_slot(name);
+      }
+      entry->name = strdup(name);
+      entry->path = strdup(full_path);
+      path_cache_used++;
+      return entry->path;
     }
-    // Close pipe
-    close(fd[0]);
-    close(fd[1]);
-    // Wait for children to finish
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+    if (dir[len] == '\0')
+      break;
+    dir += len + 1; // past the ':', which may leave an empty last entry
+  }
+  return NULL;
+}
 
-    return SUCCESS;
+/**
+ * Drop a cached path that turned out to be stale
+ */
+void path_forget(const char *name) {
+  struct path_cache_entry *entry = path_cache_slot(name);
+  if (entry == NULL || entry->name == NULL)
+    return;
+  // Reinsert the rest of the table so open addressing chains stay intact
+  struct path_cache_entry saved[PATH_CACHE_SLOTS];
+  memcpy(saved, path_cache, sizeof(saved));
+  memset(path_cache, 0, sizeof(path_cache));
+  path_cache_used = 0;
+  for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+    if (saved[i].name == NULL)
+      continue;
+    if (strcmp(saved[i].name, name) == 0) {
+      free(saved[i].name);
+      free(saved[i].path);
+      continue;
+    }
+    *path_cache_slot(saved[i].name) = saved[i];
+    path_cache_used++;
   }
+}
 
+/**
+ * Resolve every external program of a pipeline in this process, so that
+ * the children forked for it find their paths already cached
+ */
+void path_prime(struct command_t *command) {
+  for (struct command_t *c = command; c; c = c->next)
+    if (c->name && c->name[0] && !is_builtin(c))
+      path_lookup(c->name);
+}
 
+// Pipeline fusion
+// Adjacent streaming builtins of a pipeline run as threads of the shell and
+// hand blocks to each other by reference through single-producer/single-
+// consumer rings. Kernel pipes are only used where a fused group meets an
+// external command.
 
+#define FUSE_BLOCK_SIZE 65536
+#define FUSE_RING_SLOTS 64 // must be a power of two
+#define FUSE_SPINS 64      // yields before a waiting side sleeps on a futex
 
+// Toggled by the 'fuse' builtin. Off, every stage that has a real program
+// behind it (cut, head, wc, grep, tr, cat, tee) runs that program instead
+// of a thread; only memo and bare redirections stay in-process.
+bool fuse_pipelines = true;
 
+struct fuse_block {
+  size_t len;
+  char data[FUSE_BLOCK_SIZE];
+};
 
-  //Built-in Commands
+struct fuse_ring {
+  struct fuse_block *slots[FUSE_RING_SLOTS]; // a NULL entry marks end of data
+  _Atomic uint32_t head;      // next slot the consumer reads
+  _Atomic uint32_t tail;      // next slot the producer fills
+  _Atomic uint32_t space_seq; // bumped whenever a slot frees up
+  atomic_bool closed;         // consumer stopped reading
+  atomic_bool consumer_waiting;
+  atomic_bool producer_waiting;
+};
 
-  int r;
-  if (strcmp(command->name, "") == 0)
-    return SUCCESS;
+struct fuse_out;
 
-  if (strcmp(command->name, "exit") == 0)
-    return EXIT;
+struct fuse_in {
+  int fd; // used when ring is NULL
+  bool close_fd;
+  struct fuse_ring *ring;
+  struct fuse_block *block; // block being consumed
+  size_t pos;
+  bool eof;
+  char *line; // holds lines that span blocks
+  size_t line_cap;
+  struct fuse_out *flush; // flushed before this input waits for data
+};
 
-  if (strcmp(command->name, "cd") == 0) {
-    if (command->arg_count > 0) {
-      r = chdir(command->args[1]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+struct fuse_out {
+  int fd; // used when ring is NULL and memory_sink is off
+  bool close_fd;
+  struct fuse_ring *ring;
+  struct fuse_block *block; // block being filled
+  bool broken;              // nobody reads the other end anymore
+  bool memory_sink;         // collect the output in memory instead
+  char *memory;
+  size_t memory_len, memory_cap;
+};
+
+void futex_wait(_Atomic uint32_t *word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(_Atomic uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Hand a block to the consumer of a ring
+ * @param  ring  ring to push into
+ * @param  block block to pass, NULL for end of data
+ * @return       false when the consumer has gone away
+ */
+bool fuse_ring_push(struct fuse_ring *ring, struct fuse_block *block) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  int spins = 0;
+  while (tail - atomic_load(&ring->head) == FUSE_RING_SLOTS) {
+    if (atomic_load(&ring->closed))
+      return false;
+    if (spins++ < FUSE_SPINS) {
+      sched_yield();
+      continue;
+    }
+    uint32_t seq = atomic_load(&ring->space_seq);
+    atomic_store(&ring->producer_waiting, true);
+    if (tail - atomic_load(&ring->head) == FUSE_RING_SLOTS &&
+        !atomic_load(&ring->closed))
+      futex_wait(&ring->space_seq, seq);
+  }
+  if (atomic_load(&ring->closed))
+    return false;
+  ring->slots[tail & (FUSE_RING_SLOTS - 1)] = block;
+  atomic_store(&ring->tail, tail + 1);
+  if (atomic_exchange(&ring->consumer_waiting, false))
+    futex_wake(&ring->tail);
+  return true;
+}
+
+/**
+ * Take the next block out of a ring, waiting for the producer if needed
+ * @return block, NULL at end of data
+ */
+struct fuse_block *fuse_ring_pop(struct fuse_ring *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  int spins = 0;
+  while (atomic_load(&ring->tail) == head) {
+    if (spins++ < FUSE_SPINS) {
+      sched_yield();
+      continue;
+    }
+    atomic_store(&ring->consumer_waiting, true);
+    if (atomic_load(&ring->tail) == head)
+      futex_wait(&ring->tail, head);
+  }
+  struct fuse_block *block = ring->slots[head & (FUSE_RING_SLOTS - 1)];
+  atomic_store(&ring->head, head + 1);
+  atomic_fetch_add(&ring->space_seq, 1);
+  if (atomic_exchange(&ring->producer_waiting, false))
+    futex_wake(&ring->space_seq);
+  return block;
+}
+
+/**
+ * Tell the producer of a ring to stop, like closing the read end of a pipe
+ */
+void fuse_ring_close(struct fuse_ring *ring) {
+  atomic_store(&ring->closed, true);
+  atomic_fetch_add(&ring->space_seq, 1);
+  futex_wake(&ring->space_seq);
+}
+
+bool fuse_out_send(struct fuse_out *out, struct fuse_block *block) {
+  if (out->broken) {
+    free(block);
+    return false;
+  }
+  if (out->ring) {
+    if (!fuse_ring_push(out->ring, block)) {
+      free(block);
+      out->broken = true;
+    }
+  } else if (out->memory_sink) {
+    if (out->memory_len + block->len + 1 > out->memory_cap) {
+      size_t cap = out->memory_cap ? out->memory_cap : 4096;
+      while (out->memory_len + block->len + 1 > cap)
+        cap *= 2;
+      out->memory = (char *)realloc(out->memory, cap);
+      out->memory_cap = cap;
+    }
+    memcpy(out->memory + out->memory_len, block->data, block->len);
+    out->memory_len += block->len;
+    free(block);
+  } else {
+    if (!write_all(out->fd, block->data, block->len))
+      out->broken = true;
+    free(block);
+  }
+  return !out->broken;
+}
+
+/**
+ * Pass on whatever the stage has written so far
+ * @return false when the reader is gone
+ */
+bool fuse_out_flush(struct fuse_out *out) {
+  struct fuse_block *block = out->block;
+  out->block = NULL;
+  if (!block || block->len == 0) {
+    free(block);
+    return !out->broken;
+  }
+  return fuse_out_send(out, block);
+}
+
+/**
+ * Pass a whole block downstream without copying it
+ * @param  block block owned by the caller, ownership moves on
+ */
+bool fuse_out_block(struct fuse_out *out, struct fuse_block *block) {
+  if (!fuse_out_flush(out)) {
+    free(block);
+    return false;
+  }
+  return fuse_out_send(out, block);
+}
+
+/**
+ * Append bytes to the stage output
+ * @return false when the reader is gone
+ */
+bool fuse_out_write(struct fuse_out *out, const char *data, size_t len) {
+  while (len > 0) {
+    if (out->broken)
+      return false;
+    if (!out->block) {
+      out->block = (struct fuse_block *)malloc(sizeof(struct fuse_block));
+      out->block->len = 0;
+    }
+    size_t room = FUSE_BLOCK_SIZE - out->block->len;
+    size_t n = len < room ? len : room;
+    memcpy(out->block->data + out->block->len, data, n);
+    out->block->len += n;
+    data += n;
+    len -= n;
+    if (out->block->len == FUSE_BLOCK_SIZE && !fuse_out_flush(out))
+      return false;
+  }
+  return !out->broken;
+}
+
+/**
+ * Make sure the input has unread bytes in its current block
+ * @return false at end of input
+ */
+bool fuse_in_fill(struct fuse_in *in) {
+  while (!in->block || in->pos >= in->block->len) {
+    free(in->block);
+    in->block = NULL;
+    in->pos = 0;
+    if (in->eof)
+      return false;
+    // about to wait: let downstream see what we have so far
+    if (in->flush && (!in->ring || atomic_load(&in->ring->tail) ==
+                                       atomic_load(&in->ring->head)))
+      fuse_out_flush(in->flush);
+    if (in->ring) {
+      in->block = fuse_ring_pop(in->ring);
+    } else {
+      struct fuse_block *block =
+          (struct fuse_block *)malloc(sizeof(struct fuse_block));
+      ssize_t n;
+      do
+        n = read(in->fd, block->data, FUSE_BLOCK_SIZE);
+      while (n == -1 && errno == EINTR);
+      if (n > 0) {
+        block->len = n;
+        in->block = block;
+      } else
+        free(block);
+    }
+    if (!in->block)
+      in->eof = true;
+  }
+  return true;
+}
+
+/**
+ * Take the next input block whole, for stages that work on raw bytes
+ * @return block owned by the caller, NULL at end of input
+ */
+struct fuse_block *fuse_in_block(struct fuse_in *in) {
+  if (!fuse_in_fill(in))
+    return NULL;
+  struct fuse_block *block = in->block;
+  if (in->pos > 0) {
+    block->len -= in->pos;
+    memmove(block->data, block->data + in->pos, block->len);
+  }
+  in->block = NULL;
+  in->pos = 0;
+  return block;
+}
+
+/**
+ * Next input line, newline included when present
+ * @param  line set to the line, valid until the next call
+ * @return      line length, 0 at end of input
+ */
+size_t fuse_in_line(struct fuse_in *in, char **line) {
+  size_t carried = 0;
+  while (fuse_in_fill(in)) {
+    char *start = in->block->data + in->pos;
+    size_t avail = in->block->len - in->pos;
+    char *nl = (char *)memchr(start, '\n', avail);
+    size_t take = nl ? (size_t)(nl - start) + 1 : avail;
+    in->pos += take;
+    if (nl && carried == 0) { // whole line inside one block, no copy
+      *line = start;
+      return take;
+    }
+    if (carried + take > in->line_cap) {
+      in->line_cap = (carried + take) * 2;
+      in->line = (char *)realloc(in->line, in->line_cap);
+    }
+    memcpy(in->line + carried, start, take);
+    carried += take;
+    if (nl)
+      break;
+  }
+  *line = in->line;
+  return carried;
+}
+
+// Streaming builtins. Each one checks its arguments in a *_options helper so
+// that the fusion planner can fall back to the external program for anything
+// it does not understand (file operands, unknown flags).
+
+bool head_options(struct command_t *command, long *count) {
+  *count = 10;
+  for (int i = 1; command->args[i] != NULL; i++) {
+    char *arg = command->args[i];
+    if (strcmp(arg, "-n") == 0 && command->args[i + 1] != NULL)
+      *count = atol(command->args[++i]);
+    else if (strncmp(arg, "-n", 2) == 0 && isdigit(arg[2]))
+      *count = atol(arg + 2);
+    else if (arg[0] == '-' && isdigit(arg[1]))
+      *count = atol(arg + 1);
+    else
+      return false;
+  }
+  return true;
+}
+
+int filter_head(struct command_t *command, struct fuse_in *in,
+                struct fuse_out *out) {
+  long count;
+  head_options(command, &count);
+  char *line;
+  size_t len;
+  while (count > 0 && (len = fuse_in_line(in, &line)) > 0) {
+    if (!fuse_out_write(out, line, len))
+      break;
+    count--;
+  }
+  return 0;
+}
+
+bool wc_options(struct command_t *command, bool *lines, bool *words,
+                bool *bytes) {
+  *lines = *words = *bytes = false;
+  for (int i = 1; command->args[i] != NULL; i++) {
+    char *arg = command->args[i];
+    if (arg[0] != '-' || arg[1] == '\0')
+      return false;
+    for (int j = 1; arg[j]; j++) {
+      if (arg[j] == 'l')
+        *lines = true;
+      else if (arg[j] == 'w')
+        *words = true;
+      else if (arg[j] == 'c')
+        *bytes = true;
+      else
+        return false;
+    }
+  }
+  if (!*lines && !*words && !*bytes)
+    *lines = *words = *bytes = true;
+  return true;
+}
+
+int filter_wc(struct command_t *command, struct fuse_in *in,
+              struct fuse_out *out) {
+  bool show_lines, show_words, show_bytes;
+  wc_options(command, &show_lines, &show_words, &show_bytes);
+  long lines = 0, words = 0, bytes = 0;
+  bool in_word = false;
+  struct fuse_block *block;
+  while ((block = fuse_in_block(in)) != NULL) {
+    bytes += block->len;
+    for (size_t i = 0; i < block->len; i++) {
+      char c = block->data[i];
+      if (c == '\n')
+        lines++;
+      bool space = isspace((unsigned char)c);
+      if (!space && !in_word)
+        words++;
+      in_word = !space;
+    }
+    free(block);
+  }
+
+  // a single count is printed bare, several are padded like coreutils
+  long counts[3] = {lines, words, bytes};
+  bool shown[3] = {show_lines, show_words, show_bytes};
+  int columns = show_lines + show_words + show_bytes;
+  char result[128];
+  int len = 0;
+  for (int i = 0; i < 3; i++) {
+    if (!shown[i])
+      continue;
+    len += sprintf(result + len, columns > 1 ? "%s%7ld" : "%s%ld",
+                   len ? " " : "", counts[i]);
+  }
+  result[len++] = '\n';
+  fuse_out_write(out, result, len);
+  return 0;
+}
+
+bool grep_options(struct command_t *command, char **pattern, bool *invert,
+                  bool *count_only) {
+  bool fixed = false;
+  *pattern = NULL;
+  *invert = *count_only = false;
+  for (int i = 1; command->args[i] != NULL; i++) {
+    char *arg = command->args[i];
+    if (arg[0] == '-' && arg[1] != '\0' && *pattern == NULL) {
+      for (int j = 1; arg[j]; j++) {
+        if (arg[j] == 'F')
+          fixed = true;
+        else if (arg[j] == 'v')
+          *invert = true;
+        else if (arg[j] == 'c')
+          *count_only = true;
+        else
+          return false;
+      }
+    } else if (*pattern == NULL)
+      *pattern = arg;
+    else
+      return false; // file operands are left to the real grep
+  }
+  return fixed && *pattern != NULL;
+}
+
+int filter_grep(struct command_t *command, struct fuse_in *in,
+                struct fuse_out *out) {
+  char *pattern;
+  bool invert, count_only;
+  grep_options(command, &pattern, &invert, &count_only);
+  size_t pattern_len = strlen(pattern);
+  long matched = 0;
+  char *line;
+  size_t len;
+  while ((len = fuse_in_line(in, &line)) > 0) {
+    size_t body = line[len - 1] == '\n' ? len - 1 : len;
+    bool hit = memmem(line, body, pattern, pattern_len) != NULL;
+    if (hit == invert)
+      continue;
+    matched++;
+    if (count_only)
+      continue;
+    if (!fuse_out_write(out, line, body) || !fuse_out_write(out, "\n", 1))
+      break;
+  }
+  if (count_only) {
+    char result[32];
+    int n = sprintf(result, "%ld\n", matched);
+    fuse_out_write(out, result, n);
+  }
+  return matched ? 0 : 1;
+}
+
+/**
+ * Expand a tr set such as "a-z", "\n" or "[:upper:]"
+ * @param  spec set as written on the command line
+ * @param  set  receives the characters, at most 256
+ * @return      number of characters in the set
+ */
+int tr_expand_set(const char *spec, unsigned char *set) {
+  int n = 0;
+  while (*spec && n < 256) {
+    if (strncmp(spec, "[:lower:]", 9) == 0 ||
+        strncmp(spec, "[:upper:]", 9) == 0) {
+      char first = spec[2] == 'l' ? 'a' : 'A';
+      for (int i = 0; i < 26 && n < 256; i++)
+        set[n++] = first + i;
+      spec += 9;
+      continue;
+    }
+    unsigned char c = *spec++;
+    if (c == '\\' && *spec) {
+      char e = *spec++;
+      c = e == 'n' ? '\n' : e == 't' ? '\t' : e == 'r' ? '\r' : e;
+    }
+    if (spec[0] == '-' && spec[1]) { // range
+      unsigned char last = spec[1];
+      spec += 2;
+      for (int i = c; i <= last && n < 256; i++)
+        set[n++] = i;
+    } else
+      set[n++] = c;
+  }
+  return n;
+}
+
+/**
+ * Whether tr_expand_set understands every construct of a set: other
+ * classes, [=c=] and [c*n] are left to the external tr
+ */
+bool tr_set_supported(const char *spec) {
+  for (; *spec; spec++) {
+    if (*spec == '\\' && spec[1]) {
+      spec++;
+      continue;
+    }
+    if (spec[0] != '[')
+      continue;
+    if (strncmp(spec, "[:lower:]", 9) == 0 ||
+        strncmp(spec, "[:upper:]", 9) == 0) {
+      spec += 8;
+      continue;
+    }
+    if (spec[1] == ':' || spec[1] == '=' || (spec[1] && spec[2] == '*'))
+      return false;
+  }
+  return true;
+}
+
+bool tr_options(struct command_t *command, bool *delete, char **set1,
+                char **set2) {
+  int i = 1;
+  *delete = false;
+  *set1 = *set2 = NULL;
+  if (command->args[i] && strcmp(command->args[i], "-d") == 0) {
+    *delete = true;
+    i++;
+  }
+  // any other option (-s, -c, ...) is for the external tr
+  if (!command->args[i] || command->args[i][0] == '\0' ||
+      command->args[i][0] == '-')
+    return false;
+  *set1 = command->args[i++];
+  if (!*delete) {
+    if (!command->args[i] || command->args[i][0] == '\0')
+      return false;
+    *set2 = command->args[i++];
+  }
+  return command->args[i] == NULL && tr_set_supported(*set1) &&
+         (*set2 == NULL || tr_set_supported(*set2));
+}
+
+int filter_tr(struct command_t *command, struct fuse_in *in,
+              struct fuse_out *out) {
+  bool delete;
+  char *spec1, *spec2;
+  tr_options(command, &delete, &spec1, &spec2);
+  unsigned char set1[256], set2[256], map[256];
+  bool drop[256] = {false};
+  int n1 = tr_expand_set(spec1, set1);
+  int n2 = delete ? 0 : tr_expand_set(spec2, set2);
+  for (int i = 0; i < 256; i++)
+    map[i] = i;
+  for (int i = 0; i < n1; i++) {
+    if (delete)
+      drop[set1[i]] = true;
+    else // a short second set repeats its last character
+      map[set1[i]] = set2[i < n2 ? i : n2 - 1];
+  }
+
+  // blocks are rewritten in place and passed on by reference
+  struct fuse_block *block;
+  while ((block = fuse_in_block(in)) != NULL) {
+    unsigned char *data = (unsigned char *)block->data;
+    if (delete) {
+      size_t kept = 0;
+      for (size_t i = 0; i < block->len; i++)
+        if (!drop[data[i]])
+          data[kept++] = data[i];
+      block->len = kept;
+      if (kept == 0) {
+        free(block);
+        continue;
+      }
+    } else {
+      for (size_t i = 0; i < block->len; i++)
+        data[i] = map[data[i]];
+    }
+    if (!fuse_out_block(out, block))
+      break;
+  }
+  return 0;
+}
+
+bool cut_options(struct command_t *command) {
+  (void)command; // file operands are read by filter_cut itself
+  return true;
+}
+
+/**
+ * Print the selected fields of every line of one input
+ * @return false once the output is gone
+ */
+bool cut_lines(struct fuse_in *in, struct fuse_out *out, char delimiter,
+               int *fields, int field_count) {
+  // Walk each line field by field, copying selected fields straight out
+  char *line;
+  size_t len;
+  while ((len = fuse_in_line(in, &line)) > 0) {
+    if (line[len - 1] == '\n')
+      len--;
+    int token_count = 0;
+    int printed = 0;
+    size_t start = 0;
+    while (start <= len) {
+      char *end = (char *)memchr(line + start, delimiter, len - start);
+      size_t stop = end ? (size_t)(end - line) : len;
+      token_count++;
+      for (int i = 0; i < field_count; i++) {
+        if (token_count == fields[i]) {
+          if (printed)
+            fuse_out_write(out, &delimiter, 1);
+          fuse_out_write(out, line + start, stop - start);
+          printed = 1;
+        }
+      }
+      start = stop + 1;
+    }
+    if (!fuse_out_write(out, "\n", 1))
+      return false;
+  }
+  return true;
+}
+
+int filter_cut(struct command_t *command, struct fuse_in *in,
+               struct fuse_out *out) {
+  char delimiter = '\t'; // Deault delimeter is tab
+  char *fields_string = NULL;
+  int delimiter_seen = 0;
+  int field_seen = 0;
+  char message[64];
+  char **files = (char **)malloc(sizeof(char *) * command->arg_count);
+  int file_count = 0;
+
+  for (int i = 1; command->args[i] != NULL; i++) {
+    if (strncmp(command->args[i], "-d", 2) == 0 && delimiter_seen == 0) {
+      if (command->args[i][2] != '\0') // -d, written together
+        delimiter = command->args[i][2];
+      else if (command->args[i + 1] == NULL) {
+        strcpy(message, "Missing delimiter\n");
+        fuse_out_write(out, message, strlen(message));
+        free(files);
+        return 1;
+      } else
+        delimiter = command->args[++i][0];
+      delimiter_seen++;
+    }
+
+    else if (strncmp(command->args[i], "-f", 2) == 0 && field_seen == 0) {
+      fields_string = &command->args[i][2];
+      if (fields_string[0] == '\0' && command->args[i + 1] != NULL)
+        fields_string = command->args[++i]; // -f 1,2 written apart
+
+      if (fields_string[0] == '\0') { // If nothing written after -f
+        strcpy(message, "Missing field after -f\n");
+        fuse_out_write(out, message, strlen(message));
+        free(files);
+        return 1;
+      }
+      field_seen = 1;
+    }
+
+    else if (command->args[i][0] != '-' || command->args[i][1] == '\0')
+      files[file_count++] = command->args[i];
+  }
+  if (field_seen == 0) { // Field has to be provided
+    strcpy(message, "Missing field\n");
+    fuse_out_write(out, message, strlen(message));
+    free(files);
+    return 1;
+  }
+
+  // Turn Fields into int array
+  int fields[100];
+  int field_count = 0;
+  char temp[256];
+  strncpy(temp, fields_string, sizeof(temp) - 1); // strtok change original
+  temp[sizeof(temp) - 1] = '\0';
+
+  char *save; // strtok_r: fused stages run as threads
+  char *token = strtok_r(temp, ",", &save);
+  while (token != NULL && field_count < 100) {
+    fields[field_count] = atoi(token);
+    field_count++;
+    token = strtok_r(NULL, ",", &save);
+  }
+
+  if (file_count == 0) {
+    cut_lines(in, out, delimiter, fields, field_count);
+    free(files);
+    return 0;
+  }
+  // file operands are read in turn, "-" being the stage's own input
+  int status = 0;
+  for (int i = 0; i < file_count; i++) {
+    if (strcmp(files[i], "-") == 0) {
+      if (!cut_lines(in, out, delimiter, fields, field_count))
+        break;
+      continue;
+    }
+    struct fuse_in file;
+    memset(&file, 0, sizeof(file));
+    file.fd = open(files[i], O_RDONLY | O_CLOEXEC);
+    if (file.fd == -1) {
+      fprintf(stderr, "cut: %s: %s\n", files[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    file.flush = in->flush;
+    bool more = cut_lines(&file, out, delimiter, fields, field_count);
+    close(file.fd);
+    free(file.block);
+    free(file.line);
+    if (!more)
+      break;
+  }
+  free(files);
+  return status;
+}
+
+struct fuse_filter {
+  const char *name;
+  bool (*accepts)(struct command_t *command);
+  int (*run)(struct command_t *command, struct fuse_in *in,
+             struct fuse_out *out);
+};
+
+bool head_accepts(struct command_t *command) {
+  long count;
+  return head_options(command, &count);
+}
+
+bool wc_accepts(struct command_t *command) {
+  bool lines, words, bytes;
+  return wc_options(command, &lines, &words, &bytes);
+}
+
+bool grep_accepts(struct command_t *command) {
+  char *pattern;
+  bool invert, count_only;
+  return grep_options(command, &pattern, &invert, &count_only);
+}
+
+bool tr_accepts(struct command_t *command) {
+  bool delete;
+  char *set1, *set2;
+  return tr_options(command, &delete, &set1, &set2);
+}
+
+struct fuse_filter fuse_filters[] = {
+    {"cut", cut_options, filter_cut},  {"head", head_accepts, filter_head},
+    {"wc", wc_accepts, filter_wc},     {"grep", grep_accepts, filter_grep},
+    {"tr", tr_accepts, filter_tr},
+};
+
+/**
+ * Find the streaming builtin that can run a command in-process
+ * @return filter, NULL when the command has to run as its own process
+ */
+struct fuse_filter *fuse_filter_for(struct command_t *command) {
+  if (!fuse_pipelines)
+    return NULL;
+  for (size_t i = 0; i < sizeof(fuse_filters) / sizeof(fuse_filters[0]); i++)
+    if (strcmp(command->name, fuse_filters[i].name) == 0)
+      return fuse_filters[i].accepts(command) ? &fuse_filters[i] : NULL;
+  return NULL;
+}
+
+// Data movers
+// cat, tee and bare redirections only shuffle bytes between descriptors, so
+// they pick the cheapest kernel path for each pair of file types and keep a
+// plain read/write loop as the fallback.
+
+#define MOVE_CHUNK (1 << 20)
+
+/**
+ * Whether a failed fast-path call means "not for this pair of files"
+ */
+bool move_unsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV ||
+         err == EOPNOTSUPP || err == EBADF;
+}
+
+#define MOVE_SAME_FILE -2 // move_data refused to copy a file into itself
+
+/**
+ * The zero-copy half of move_data: copy_file_range between regular files,
+ * splice when either side is a pipe
+ * @param append put every chunk at the end of the output, whose O_APPEND
+ *               both calls refuse and had to come off
+ * @return 0 on success, -1 on error, 1 when neither call can be used
+ */
+int move_zero_copy(int in_fd, int out_fd, struct stat *in_st,
+                   struct stat *out_st, bool append) {
+  bool moved = false;
+  ssize_t n = 0;
+
+  if (S_ISREG(in_st->st_mode) && S_ISREG(out_st->st_mode)) {
+    while (1) {
+      if (append)
+        lseek(out_fd, 0, SEEK_END);
+      n = copy_file_range(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, 0);
+      if (n <= 0)
+        break;
+      moved = true;
+    }
+    if (n == 0)
+      return 0;
+    if (moved || !move_unsupported(errno))
+      return -1;
+  }
+
+  if (S_ISFIFO(in_st->st_mode) || S_ISFIFO(out_st->st_mode)) {
+    while (1) {
+      if (append)
+        lseek(out_fd, 0, SEEK_END);
+      n = splice(in_fd, NULL, out_fd, NULL, MOVE_CHUNK, SPLICE_F_MOVE);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      moved = true;
+    }
+    if (n == 0)
+      return 0;
+    if (moved || !move_unsupported(errno))
+      return -1;
+  }
+  return 1;
+}
+
+/**
+ * Copy everything from one descriptor to another: zero-copy where the
+ * kernel allows it, then sendfile out of a regular file, read/write
+ * otherwise. An O_APPEND output keeps the flag except while a zero-copy
+ * call runs.
+ * @return 0 on success, -1 on error, MOVE_SAME_FILE when the output is the
+ *         input file with data still ahead of the read offset, which like
+ *         GNU cat is refused since "cat a >> a" would never end
+ */
+int move_data(int in_fd, int out_fd) {
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+    return -1;
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode) &&
+      in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino &&
+      lseek(in_fd, 0, SEEK_CUR) < out_st.st_size)
+    return MOVE_SAME_FILE;
+
+  int flags = fcntl(out_fd, F_GETFL);
+  bool append = flags != -1 && (flags & O_APPEND);
+  if (append)
+    fcntl(out_fd, F_SETFL, flags & ~O_APPEND);
+  int zero_copy = move_zero_copy(in_fd, out_fd, &in_st, &out_st, append);
+  if (append) {
+    int error = errno;
+    fcntl(out_fd, F_SETFL, flags);
+    errno = error;
+  }
+  if (zero_copy != 1)
+    return zero_copy;
+
+  bool moved = false;
+  ssize_t n;
+  if (S_ISREG(in_st.st_mode)) {
+    while ((n = sendfile(out_fd, in_fd, NULL, MOVE_CHUNK)) > 0 ||
+           (n == -1 && errno == EINTR))
+      moved = true;
+    if (n == 0)
+      return 0;
+    if (moved || !move_unsupported(errno))
+      return -1;
+  }
+
+  char *buffer = (char *)malloc(MOVE_CHUNK);
+  int result = 0;
+  while (1) {
+    n = read(in_fd, buffer, MOVE_CHUNK);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      result = n == 0 ? 0 : -1;
+      break;
+    }
+    if (!write_all(out_fd, buffer, n)) {
+      result = -1;
+      break;
+    }
+  }
+  free(buffer);
+  return result;
+}
+
+/**
+ * Move n bytes that are known to be waiting in a pipe into a descriptor
+ * @return how many of them could not be moved, 0 on success
+ */
+size_t splice_exactly(int pipe_fd, int out_fd, size_t n) {
+  while (n > 0) {
+    ssize_t moved = splice(pipe_fd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINTR)
+      continue;
+    if (moved <= 0)
+      break;
+    n -= moved;
+  }
+  return n;
+}
+
+/**
+ * Throw away n bytes that are known to be waiting in a pipe
+ */
+bool discard_exactly(int pipe_fd, size_t n) {
+  char buffer[4096];
+  while (n > 0) {
+    size_t want = n < sizeof(buffer) ? n : sizeof(buffer);
+    ssize_t got = read(pipe_fd, buffer, want);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    n -= got;
+  }
+  return true;
+}
+
+/**
+ * Duplicate a pipe into another pipe and files without copying through
+ * userspace: tee(2) feeds the output pipe and a scratch pipe per extra file,
+ * the last file consumes the data with splice. Files are dropped as in
+ * tee_to_files.
+ * @return 0 on success, 1 on error, -1 if this pair of files is unsupported
+ */
+int tee_pipes(int in_fd, int out_fd, int *files, int file_count) {
+  struct stat in_st, out_st;
+  if (file_count == 0 || fstat(in_fd, &in_st) == -1 ||
+      fstat(out_fd, &out_st) == -1 || !S_ISFIFO(in_st.st_mode) ||
+      !S_ISFIFO(out_st.st_mode))
+    return -1;
+  // splice into a device or socket may fail half way through a chunk, or
+  // behave differently, and it refuses O_APPEND (tee -a); those targets
+  // take the buffered path
+  for (int i = 0; i < file_count; i++) {
+    struct stat st;
+    int flags = fcntl(files[i], F_GETFL);
+    if (fstat(files[i], &st) == -1 ||
+        !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) || flags == -1 ||
+        (flags & O_APPEND))
+      return -1;
+  }
+
+  // the scratch pipe must take a whole tee of the input in one go, otherwise
+  // the next tee would start again at the same bytes
+  int scratch[2] = {-1, -1};
+  if (file_count > 1) {
+    if (pipe2(scratch, O_CLOEXEC) == -1)
+      return -1;
+    int size = fcntl(in_fd, F_GETPIPE_SZ);
+    if (size == -1 || fcntl(scratch[1], F_SETPIPE_SZ, size) < size) {
+      close(scratch[0]);
+      close(scratch[1]);
+      return -1;
+    }
+  }
+
+  int result = 0;
+  bool started = false;
+  while (1) {
+    ssize_t n = tee(in_fd, out_fd, MOVE_CHUNK, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == 0)
+      break;
+    if (n == -1) {
+      result = !started && move_unsupported(errno) ? -1 : 1;
+      break;
+    }
+    started = true;
+    int last = file_count - 1;
+    while (last >= 0 && files[last] == -1)
+      last--;
+    for (int i = 0; i < last && result == 0; i++) {
+      if (files[i] == -1)
+        continue;
+      ssize_t copied;
+      do
+        copied = tee(in_fd, scratch[1], n, 0);
+      while (copied == -1 && errno == EINTR);
+      if (copied != n) {
+        result = 1;
+        break;
+      }
+      size_t left = splice_exactly(scratch[0], files[i], n);
+      if (left) {
+        close(files[i]);
+        files[i] = -1;
+        if (!discard_exactly(scratch[0], left))
+          result = 1;
+      }
+    }
+    // the last file still taking data consumes the input, else it is dropped
+    size_t left = n;
+    if (result == 0 && last >= 0 &&
+        (left = splice_exactly(in_fd, files[last], n)) != 0) {
+      close(files[last]);
+      files[last] = -1;
+    }
+    if (result != 0 || (left && !discard_exactly(in_fd, left))) {
+      result = 1;
+      break;
+    }
+  }
+  if (scratch[0] != -1) {
+    close(scratch[0]);
+    close(scratch[1]);
+  }
+  return result;
+}
+
+/**
+ * Copy a descriptor to another one and to files, through tee(2) when both
+ * ends are pipes and through a buffer otherwise. A file that fails to take
+ * a write, e.g. on a full disk, is closed and set to -1 in files, and the
+ * copy goes on without it.
+ * @return 0 when out_fd got everything, 1 on error
+ */
+int tee_to_files(int in_fd, int out_fd, int *files, int file_count) {
+  int result = tee_pipes(in_fd, out_fd, files, file_count);
+  if (result != -1)
+    return result;
+
+  char *buffer = (char *)malloc(MOVE_CHUNK);
+  ssize_t n;
+  result = 0;
+  while ((n = read(in_fd, buffer, MOVE_CHUNK)) > 0 ||
+         (n == -1 && errno == EINTR)) {
+    if (n == -1)
+      continue;
+    if (!write_all(out_fd, buffer, n)) {
+      result = 1;
+      break;
+    }
+    for (int i = 0; i < file_count; i++)
+      if (files[i] != -1 && !write_all(files[i], buffer, n)) {
+        close(files[i]);
+        files[i] = -1;
+      }
+  }
+  free(buffer);
+  return result;
+}
+
+/**
+ * Open a file for a >> style write. move_data takes care of the zero-copy
+ * calls that refuse O_APPEND.
+ */
+int open_for_append(const char *path) {
+  return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+bool cat_accepts(struct command_t *command) {
+  for (int i = 1; command->args[i] != NULL; i++)
+    if (command->args[i][0] == '-' && command->args[i][1] != '\0')
+      return false; // cat -n and friends are left to the real cat
+  return true;
+}
+
+int builtin_cat(struct command_t *command, int in_fd, int out_fd) {
+  int status = 0;
+  if (command->args[1] == NULL)
+    return move_data(in_fd, out_fd) == 0 ? 0 : 1;
+  for (int i = 1; command->args[i] != NULL; i++) {
+    int fd = in_fd;
+    if (strcmp(command->args[i], "-") != 0) {
+      fd = open(command->args[i], O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+        fprintf(stderr, "cat: %s: %s\n", command->args[i], strerror(errno));
+        status = 1;
+        continue;
+      }
+    }
+    int moved = move_data(fd, out_fd);
+    int error = errno; // only meaningful when moved is -1
+    if (fd != in_fd)
+      close(fd);
+    if (moved == 0)
+      continue;
+    status = 1;
+    if (moved == MOVE_SAME_FILE)
+      fprintf(stderr, "cat: %s: input file is output file\n",
+              command->args[i]);
+    else if (error == EPIPE)
+      break;
+    else
+      fprintf(stderr, "cat: %s: %s\n", command->args[i], strerror(error));
+  }
+  return status;
+}
+
+bool tee_accepts(struct command_t *command) {
+  for (int i = 1; command->args[i] != NULL; i++)
+    if (command->args[i][0] == '-' && strcmp(command->args[i], "-a") != 0)
+      return false;
+  return true;
+}
+
+int builtin_tee(struct command_t *command, int in_fd, int out_fd) {
+  bool append = false;
+  int files[64], file_count = 0, status = 0;
+  char *names[64];
+  for (int i = 1; command->args[i] != NULL; i++)
+    if (strcmp(command->args[i], "-a") == 0)
+      append = true;
+  for (int i = 1; command->args[i] != NULL && file_count < 64; i++) {
+    if (strcmp(command->args[i], "-a") == 0)
+      continue;
+    int fd = append ? open_for_append(command->args[i])
+                    : open(command->args[i],
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "tee: %s: %s\n", command->args[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    names[file_count] = command->args[i];
+    files[file_count++] = fd;
+  }
+
+  int result = file_count ? tee_to_files(in_fd, out_fd, files, file_count)
+                          : (move_data(in_fd, out_fd) == 0 ? 0 : 1);
+  for (int i = 0; i < file_count; i++) {
+    if (files[i] != -1) {
+      close(files[i]);
+      continue;
+    }
+    fprintf(stderr, "tee: %s: write error\n", names[i]);
+    status = 1;
+  }
+  return status || result;
+}
+
+bool redirect_accepts(struct command_t *command) {
+  return command->redirects[0] || command->redirects[1] ||
+         command->redirects[2];
+}
+
+/**
+ * A command line made only of redirections, e.g. "<in >out"
+ * @param in_fd -1 when there is nothing to read, as in a bare ">out"
+ */
+int builtin_redirect(struct command_t *command, int in_fd, int out_fd) {
+  if (in_fd == -1)
+    return 0; // the output files have been created, like in bash
+  int moved = move_data(in_fd, out_fd);
+  if (moved == MOVE_SAME_FILE)
+    fprintf(stderr, "-%s: %s: input file is output file\n", sysname,
+            command->redirects[0]);
+  return moved == 0 ? 0 : 1;
+}
+
+/**
+ * Parse a size such as "4096", "64K", "512M" or "2G"
+ * @return size in bytes, -1 if the text is not a size
+ */
+long parse_size(const char *text) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || value < 0)
+    return -1;
+  switch (toupper(*end)) {
+  case 'T':
+    value <<= 10; // fall through
+  case 'G':
+    value <<= 10; // fall through
+  case 'M':
+    value <<= 10; // fall through
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  }
+  if (toupper(*end) == 'B')
+    end++;
+  return *end == '\0' ? value : -1;
+}
+
+/**
+ * A command made of the arguments of another one, e.g. the "cmd ..." part
+ * of "memo cmd ...". Shares the strings of the original command.
+ * @param first index of the argument that becomes the name
+ */
+struct command_t subcommand(struct command_t *command, int first) {
+  struct command_t inner;
+  memset(&inner, 0, sizeof(inner));
+  inner.name = command->args[first];
+  inner.args = command->args + first;
+  inner.arg_count = command->arg_count - first;
+  return inner;
+}
+
+// Output memoization
+// memo keeps the stdout and exit status of a command in a content addressed
+// store. The key covers argv, the working directory, a few environment
+// variables and the identity (size, mtime, inode) of every input file, so a
+// re-run on unchanged inputs replays the stored output without forking.
+// memo wraps one simple command: in "memo a | b" only a is memoized, and b
+// runs every time.
+
+#define MEMO_HEADER "shellish-memo %3d\n"
+#define MEMO_HEADER_LEN 18
+#define MEMO_DEFAULT_MAX (256L << 20) // SHELLISH_MEMO_MAX overrides it
+
+struct memo_key {
+  uint64_t h[2];
+};
+
+/**
+ * Mix bytes into a key: two FNV-1a style streams with different multipliers
+ */
+void memo_hash(struct memo_key *key, const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++) {
+    key->h[0] = (key->h[0] ^ bytes[i]) * 0x100000001b3ULL;
+    key->h[1] = (key->h[1] ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+  }
+}
+
+void memo_hash_string(struct memo_key *key, const char *text) {
+  memo_hash(key, text, strlen(text) + 1); // the NUL separates fields
+}
+
+void memo_hash_file(struct memo_key *key, const char *path,
+                    struct stat *st) {
+  memo_hash_string(key, path);
+  memo_hash(key, &st->st_dev, sizeof(st->st_dev));
+  memo_hash(key, &st->st_ino, sizeof(st->st_ino));
+  memo_hash(key, &st->st_size, sizeof(st->st_size));
+  memo_hash(key, &st->st_mtim, sizeof(st->st_mtim));
+}
+
+/**
+ * Build the cache key of a memoized command
+ * @param in_st status of its standard input, NULL when it is not a file
+ */
+void memo_key_of(struct command_t *command, struct stat *in_st,
+                 struct memo_key *key) {
+  key->h[0] = 0xcbf29ce484222325ULL;
+  key->h[1] = 0x84222325cbf29ce4ULL;
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)))
+    memo_hash_string(key, cwd);
+
+  struct stat st;
+  for (int i = 0; command->args[i] != NULL; i++) {
+    memo_hash_string(key, command->args[i]);
+    if (i > 0 && stat(command->args[i], &st) == 0)
+      memo_hash_file(key, command->args[i], &st);
+  }
+  if (in_st)
+    memo_hash_file(key, command->redirects[0] ? command->redirects[0] : "<",
+                   in_st);
+
+  // environment that commonly changes output, plus SHELLISH_MEMO_ENV=A:B
+  const char *names[] = {"PATH", "LANG", "LC_ALL", "TZ"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    char *value = getenv(names[i]);
+    memo_hash_string(key, value ? value : "");
+  }
+  char *extra = getenv("SHELLISH_MEMO_ENV");
+  if (extra) {
+    char list[1024], *name, *save;
+    strncpy(list, extra, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    for (name = strtok_r(list, ":", &save); name;
+         name = strtok_r(NULL, ":", &save)) {
+      char *value = getenv(name);
+      memo_hash_string(key, name);
+      memo_hash_string(key, value ? value : "");
+    }
+  }
+}
+
+/**
+ * Find (and create) $XDG_CACHE_HOME/shellish, ~/.cache/shellish by default
+ * @return false when there is nowhere to keep the cache
+ */
+bool memo_cache_dir(char *dir, size_t size) {
+  char *base = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (base && base[0])
+    snprintf(dir, size, "%s", base);
+  else if (home)
+    snprintf(dir, size, "%s/.cache", home);
+  else
+    return false;
+  mkdir(dir, 0755);
+  strncat(dir, "/shellish", size - strlen(dir) - 1);
+  return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+struct memo_entry {
+  char name[64];
+  off_t size;
+  struct timespec used;
+};
+
+int memo_entry_cmp(const void *a, const void *b) {
+  const struct timespec *x = &((const struct memo_entry *)a)->used;
+  const struct timespec *y = &((const struct memo_entry *)b)->used;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/**
+ * Drop least recently used entries until the store fits its size limit.
+ * Hits touch the mtime of an entry, so mtime order is LRU order.
+ */
+void memo_evict(const char *dir) {
+  char *limit_text = getenv("SHELLISH_MEMO_MAX");
+  long limit = limit_text ? parse_size(limit_text) : -1;
+  if (limit < 0)
+    limit = MEMO_DEFAULT_MAX;
+
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct memo_entry *entries = NULL;
+  int count = 0, capacity = 0;
+  off_t total = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    struct stat st;
+    if (ent->d_name[0] == '.' || strlen(ent->d_name) >= 64 ||
+        fstatat(dirfd(d), ent->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      entries = (struct memo_entry *)realloc(
+          entries, capacity * sizeof(struct memo_entry));
+    }
+    strcpy(entries[count].name, ent->d_name);
+    entries[count].size = st.st_size;
+    entries[count].used = st.st_mtim;
+    total += st.st_size;
+    count++;
+  }
+  if (total > limit) {
+    qsort(entries, count, sizeof(struct memo_entry), memo_entry_cmp);
+    for (int i = 0; i < count && total > limit; i++)
+      if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+        total -= entries[i].size;
+  }
+  closedir(d);
+  free(entries);
+}
+
+/**
+ * Run the wrapped command with its stdout going through a pipe
+ * @param store file that receives a copy of the output, NULL for none. It
+ *              is closed and set to -1 if it stops taking writes.
+ * @return exit status, -1 if the output could not be delivered
+ */
+int memo_run(struct command_t *inner, int in_fd, int out_fd, int *store) {
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1)
+    return 1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (in_fd != -1 && in_fd != STDIN_FILENO)
+      dup2(in_fd, STDIN_FILENO);
+    dup2(p[1], STDOUT_FILENO);
+    if (!is_builtin(inner))
+      exec_with_path(inner);
+    process_command(inner);
+    exit(last_status);
+  }
+  close(p[1]);
+  int copied = store == NULL ? (move_data(p[0], out_fd) == 0 ? 0 : 1)
+                             : tee_to_files(p[0], out_fd, store, 1);
+  close(p[0]);
+  int status = 1;
+  if (waitpid(pid, &status, 0) != -1)
+    status = exit_code_of(status);
+  return copied == 0 ? status : -1;
+}
+
+int builtin_memo(struct command_t *command, int in_fd, int out_fd) {
+  if (command->args[1] == NULL) {
+    fprintf(stderr, "Usage: memo <command> [args...]\n");
+    return 2;
+  }
+  struct command_t inner = subcommand(command, 1);
+
+  // output that depends on a stream cannot be keyed, so commands reading a
+  // pipe or a socket run uncached; a regular file is keyed by its identity,
+  // size and mtime. The terminal the shell reads from is not taken as an
+  // input, or no interactive memo would ever hit.
+  struct stat in_st;
+  bool in_file = false;
+  int real_in = in_fd == -1 ? STDIN_FILENO : in_fd;
+  if (!isatty(real_in) && fstat(real_in, &in_st) == 0) {
+    if (S_ISFIFO(in_st.st_mode) || S_ISSOCK(in_st.st_mode)) {
+      int status = memo_run(&inner, in_fd, out_fd, NULL);
+      return status == -1 ? 1 : status;
+    }
+    in_file = S_ISREG(in_st.st_mode);
+  }
+
+  char dir[4096], path[4200], temp[4300];
+  if (!memo_cache_dir(dir, sizeof(dir))) {
+    int status = memo_run(&inner, in_fd, out_fd, NULL);
+    return status == -1 ? 1 : status;
+  }
+  struct memo_key key;
+  memo_key_of(&inner, in_file ? &in_st : NULL, &key);
+  snprintf(path, sizeof(path), "%s/%016llx%016llx", dir,
+           (unsigned long long)key.h[0], (unsigned long long)key.h[1]);
+
+  // hit: replay the stored output, no fork
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    char header[MEMO_HEADER_LEN + 1];
+    int status;
+    if (read(fd, header, MEMO_HEADER_LEN) == MEMO_HEADER_LEN) {
+      header[MEMO_HEADER_LEN] = '\0';
+      if (sscanf(header, "shellish-memo %d", &status) == 1) {
+        futimens(fd, NULL); // mark as recently used
+        move_data(fd, out_fd);
+        close(fd);
+        return status;
+      }
+    }
+    close(fd);
+  }
+
+  // miss: run it, copying the output into a temporary entry
+  snprintf(temp, sizeof(temp), "%s/.tmp.%d.%d", dir, getpid(), gettid());
+  int store = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (store != -1 && !write_all(store, "shellish-memo   0\n", MEMO_HEADER_LEN)) {
+    close(store);
+    unlink(temp);
+    store = -1;
+  }
+  int status = memo_run(&inner, in_fd, out_fd, store == -1 ? NULL : &store);
+  if (store == -1) { // no entry, or it could not be written in full
+    unlink(temp);
+    return status == -1 ? 1 : status;
+  }
+
+  // only complete runs are kept, and they appear atomically under the key
+  char header[MEMO_HEADER_LEN + 1];
+  snprintf(header, sizeof(header), MEMO_HEADER, status);
+  bool keep = status >= 0 && status < 128 &&
+              pwrite(store, header, MEMO_HEADER_LEN, 0) == MEMO_HEADER_LEN;
+  close(store);
+  if (keep && rename(temp, path) == 0)
+    memo_evict(dir);
+  else
+    unlink(temp);
+  return status == -1 ? 1 : status;
+}
+
+bool memo_accepts(struct command_t *command) {
+  (void)command;
+  return true;
+}
+
+struct mover_builtin {
+  const char *name;
+  bool (*accepts)(struct command_t *command);
+  int (*run)(struct command_t *command, int in_fd, int out_fd);
+  bool optional; // a program of the same name takes over with 'fuse off'
+};
+
+struct mover_builtin mover_builtins[] = {
+    {"cat", cat_accepts, builtin_cat, true},
+    {"tee", tee_accepts, builtin_tee, true},
+    {"memo", memo_accepts, builtin_memo, false},
+    {"", redirect_accepts, builtin_redirect, false},
+};
+
+/**
+ * Find the data mover that can run a command in-process
+ * @return mover, NULL when the command needs something else
+ */
+struct mover_builtin *mover_for(struct command_t *command) {
+  for (size_t i = 0; i < sizeof(mover_builtins) / sizeof(mover_builtins[0]);
+       i++)
+    if (strcmp(command->name, mover_builtins[i].name) == 0)
+      return (fuse_pipelines || !mover_builtins[i].optional) &&
+                     mover_builtins[i].accepts(command)
+                 ? &mover_builtins[i]
+                 : NULL;
+  return NULL;
+}
+
+/**
+ * Whether a command is handled by process_command without exec
+ */
+bool is_builtin(struct command_t *command) {
+  const char *names[] = {"",           "exit", "cd",   "chatroom",
+                         "battleship", "fuse", "jobs", "run", "watch",
+                         "zygote", "spawnbench", "capture", "joblog"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (strcmp(command->name, names[i]) == 0)
+      return true;
+  return fuse_filter_for(command) != NULL || mover_for(command) != NULL;
+}
+
+/**
+ * Apply the <, > and >> redirections of a command to this process
+ * @return false if a file could not be opened
+ */
+bool apply_redirects(struct command_t *command) {
+  // (<) Redirection
+  // Replace stdin with file
+  if (command->redirects[0]) {
+    int fd = open(command->redirects[0], O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0],
+              strerror(errno));
+      return false;
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+  }
+  // (>) Redirection
+  // Create or truncate file
+  if (command->redirects[1]) {
+    int fd = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[1],
+              strerror(errno));
+      return false;
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+  // (>>) Redirection
+  // Append output to file
+  if (command->redirects[2]) {
+    int fd = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[2],
+              strerror(errno));
+      return false;
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+  return true;
+}
+
+struct pipeline_stage {
+  struct command_t *command;
+  struct fuse_filter *filter; // streaming builtin running as a thread
+  struct mover_builtin *mover; // data mover running as a thread
+  pid_t pid;
+  pthread_t thread;
+  struct fuse_in in;
+  struct fuse_out out;
+  int status;
+};
+
+void *fuse_stage_main(void *arg) {
+  struct pipeline_stage *stage = (struct pipeline_stage *)arg;
+  stage->in.flush = &stage->out;
+  if (stage->mover)
+    stage->status =
+        stage->mover->run(stage->command, stage->in.fd, stage->out.fd);
+  else
+    stage->status =
+        stage->filter->run(stage->command, &stage->in, &stage->out);
+
+  // close our input first so a producer upstream stops early
+  if (stage->in.ring)
+    fuse_ring_close(stage->in.ring);
+  if (stage->in.close_fd)
+    close(stage->in.fd);
+  free(stage->in.block);
+  free(stage->in.line);
+
+  fuse_out_flush(&stage->out);
+  if (stage->out.ring)
+    fuse_ring_push(stage->out.ring, NULL);
+  if (stage->out.close_fd)
+    close(stage->out.fd);
+  return NULL;
+}
+
+/**
+ * Open the redirect files of a threaded stage in place of its pipe ends
+ * @return false if a file could not be opened
+ */
+bool fuse_stage_redirects(struct pipeline_stage *stage) {
+  struct command_t *command = stage->command;
+  if (command->redirects[0]) {
+    int fd = open(command->redirects[0], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0],
+              strerror(errno));
+      return false;
+    }
+    if (stage->in.close_fd)
+      close(stage->in.fd);
+    stage->in.fd = fd;
+    stage->in.close_fd = true;
+  }
+  for (int i = 1; i < 3; i++) {
+    if (!command->redirects[i])
+      continue;
+    int fd = i == 1 ? open(command->redirects[i],
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                    : open_for_append(command->redirects[i]);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i],
+              strerror(errno));
+      return false;
+    }
+    if (stage->out.close_fd)
+      close(stage->out.fd);
+    stage->out.fd = fd;
+    stage->out.close_fd = true;
+  }
+  return true;
+}
+
+/**
+ * Run a whole command_t->next chain. Runs of adjacent streaming builtins are
+ * fused into threads connected by rings, data movers get a thread working on
+ * plain descriptors, everything else gets a process and kernel pipes at the
+ * group boundaries.
+ * @return exit status of the last stage
+ */
+int run_pipeline(struct command_t *command) {
+  int n = 0;
+  for (struct command_t *c = command; c; c = c->next)
+    n++;
+  struct pipeline_stage *stages =
+      (struct pipeline_stage *)calloc(n, sizeof(struct pipeline_stage));
+  // stage i feeds stage i+1 through rings[i] or pipes[i]
+  struct fuse_ring **rings =
+      (struct fuse_ring **)calloc(n, sizeof(struct fuse_ring *));
+  int(*pipes)[2] = (int(*)[2])malloc(sizeof(int[2]) * n);
+  path_prime(command);
+
+  int i = 0;
+  for (struct command_t *c = command; c; c = c->next, i++) {
+    stages[i].command = c;
+    stages[i].filter = fuse_filter_for(c);
+    if (!stages[i].filter)
+      stages[i].mover = mover_for(c);
+  }
+
+  for (i = 0; i < n - 1; i++) {
+    pipes[i][0] = pipes[i][1] = -1;
+    // a stage redirecting its output (or the next its input) ends the group
+    bool fused = fuse_pipelines && stages[i].filter && stages[i + 1].filter &&
+                 !stages[i].command->redirects[1] &&
+                 !stages[i].command->redirects[2] &&
+                 !stages[i + 1].command->redirects[0];
+    if (fused)
+      rings[i] = (struct fuse_ring *)calloc(1, sizeof(struct fuse_ring));
+    else
+      pipe2(pipes[i], O_CLOEXEC);
+  }
+
+  fflush(stdout);
+
+  // external stages first, so they do not inherit the threads' state
+  for (i = 0; i < n; i++) {
+    if (stages[i].filter || stages[i].mover)
+      continue;
+    stages[i].pid = fork();
+    if (stages[i].pid == 0) {
+      if (i > 0)
+        dup2(pipes[i - 1][0], STDIN_FILENO);
+      if (i < n - 1)
+        dup2(pipes[i][1], STDOUT_FILENO);
+      // builtins do not exec, so drop every other pipe end by hand
+      for (int j = 0; j < n - 1; j++) {
+        if (pipes[j][0] != -1)
+          close(pipes[j][0]);
+        if (pipes[j][1] != -1)
+          close(pipes[j][1]);
+      }
+      if (!apply_redirects(stages[i].command))
+        exit(1);
+      stages[i].command->next = NULL;
+      if (!is_builtin(stages[i].command))
+        exec_with_path(stages[i].command);
+      process_command(stages[i].command);
+      exit(last_status);
+    }
+  }
+
+  // pipe ends used by threads stay open, the rest belong to the children
+  for (i = 0; i < n - 1; i++) {
+    if (rings[i])
+      continue;
+    if (!stages[i].filter && !stages[i].mover)
+      close(pipes[i][1]);
+    if (!stages[i + 1].filter && !stages[i + 1].mover)
+      close(pipes[i][0]);
+  }
+
+  for (i = 0; i < n; i++) {
+    struct pipeline_stage *stage = &stages[i];
+    if (!stage->filter && !stage->mover)
+      continue;
+    stage->in.fd = i > 0 && !rings[i - 1] ? pipes[i - 1][0] : STDIN_FILENO;
+    stage->in.close_fd = i > 0 && !rings[i - 1];
+    stage->in.ring = i > 0 ? rings[i - 1] : NULL;
+    stage->out.fd = i < n - 1 && !rings[i] ? pipes[i][1] : STDOUT_FILENO;
+    stage->out.close_fd = i < n - 1 && !rings[i];
+    stage->out.ring = i < n - 1 ? rings[i] : NULL;
+    if (i == 0 && stage->mover && stage->command->name[0] == '\0' &&
+        !stage->command->redirects[0])
+      stage->in.fd = -1; // a bare ">out" has nothing to copy
+    if (!fuse_stage_redirects(stage)) {
+      // behave like an empty stage so neighbours still terminate
+      stage->status = 1;
+      if (stage->in.ring)
+        fuse_ring_close(stage->in.ring);
+      if (stage->in.close_fd)
+        close(stage->in.fd);
+      if (stage->out.ring)
+        fuse_ring_push(stage->out.ring, NULL);
+      if (stage->out.close_fd)
+        close(stage->out.fd);
+      stage->filter = NULL;
+      stage->mover = NULL;
+      stage->pid = -1;
+      continue;
+    }
+    pthread_create(&stage->thread, NULL, fuse_stage_main, stage);
+  }
+
+  for (i = 0; i < n; i++) {
+    int status;
+    if (stages[i].filter || stages[i].mover)
+      pthread_join(stages[i].thread, NULL);
+    else if (stages[i].pid > 0 && waitpid(stages[i].pid, &status, 0) != -1)
+      stages[i].status = exit_code_of(status);
+  }
+
+  // blocks left behind by a consumer that stopped early
+  for (i = 0; i < n - 1; i++) {
+    if (!rings[i])
+      continue;
+    for (uint32_t s = rings[i]->head; s != rings[i]->tail; s++)
+      free(rings[i]->slots[s & (FUSE_RING_SLOTS - 1)]);
+    free(rings[i]);
+  }
+
+  last_status = stages[n - 1].status;
+  free(stages);
+  free(rings);
+  free(pipes);
+  return last_status;
+}
+
+// Jobs
+// Background jobs are remembered so that 'jobs' can list them, together with
+// the scheduling controls 'run' started them with.
+
+#define MAX_JOBS 64
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct job_settings {
+  bool has_cpus;
+  cpu_set_t cpus;
+  bool has_nice;
+  int nice;
+  int ioprio; // 0 leaves the I/O priority alone
+  long mem;   // address space limit in bytes, 0 for none
+  char summary[160];
+};
+
+struct job {
+  int id; // 0 marks a free slot
+  pid_t pid;
+  char *text;
+  char settings[160];
+  int capture_id; // its output log for joblog, 0 for none
+};
+
+struct job jobs[MAX_JOBS];
+int next_job_id = 1;
+
+/**
+ * Render a command line back to text for the job listing
+ * @return malloc'ed string
+ */
+char *command_text(struct command_t *command) {
+  size_t cap = 256, len = 0;
+  char *text = (char *)malloc(cap);
+  text[0] = '\0';
+  for (struct command_t *c = command; c; c = c->next) {
+    const char *parts[260];
+    int count = 0;
+    if (c != command)
+      parts[count++] = "|";
+    for (int i = 0; c->args[i] != NULL && count < 250; i++)
+      parts[count++] = c->args[i];
+    const char *ops[3] = {"<", ">", ">>"};
+    for (int i = 0; i < 3; i++) {
+      if (c->redirects[i]) {
+        parts[count++] = ops[i];
+        parts[count++] = c->redirects[i];
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      size_t n = strlen(parts[i]);
+      if (len + n + 2 > cap) {
+        cap = (len + n + 2) * 2;
+        text = (char *)realloc(text, cap);
+      }
+      if (len)
+        text[len++] = ' ';
+      memcpy(text + len, parts[i], n + 1);
+      len += n;
+    }
+  }
+  return text;
+}
+
+// Background output capture
+// With 'capture on', the stdout and stderr of background jobs go to a pipe
+// instead of the terminal. One drainer thread empties all of those pipes
+// with a single epoll set into a fixed-size ring per job, so a chatty job
+// costs a bounded amount of memory however much it prints. 'joblog' shows
+// what a job wrote; bytes pushed out of a full ring can be spilled to a
+// file instead of being dropped. Logs have their own ids, never reused,
+// since job numbers start over whenever the job table empties.
+#define MAX_CAPTURES 64
+#define CAPTURE_DEFAULT_SIZE (64 << 10)
+
+struct capture {
+  int id; // 0 marks a free slot
+  char *text;
+  int fd; // read end of the job's output, -1 once drained to EOF
+  int notify_fd; // eventfd bumped on every append, for followers
+  pthread_mutex_t lock; // guards everything below
+  char *data;
+  size_t size;
+  uint64_t total; // bytes written so far; the ring holds the newest ones
+  int spill_fd; // receives bytes pushed out of the ring, -1 for none
+  uint64_t spill_from; // oldest offset held when spilling began
+  bool closed;
+};
+
+bool capture_jobs = false;
+size_t capture_size = CAPTURE_DEFAULT_SIZE;
+struct capture captures[MAX_CAPTURES];
+int capture_epoll_fd = -1;
+int next_capture_id = 1;
+
+/**
+ * Append to a ring, spilling whatever gets overwritten. Called locked.
+ */
+void capture_append(struct capture *c, const char *data, size_t n) {
+  uint64_t evict_from = c->total > c->size ? c->total - c->size : 0;
+  uint64_t evict_to = c->total + n > c->size ? c->total + n - c->size : 0;
+  if (c->spill_fd != -1 && evict_to > evict_from) {
+    // first what the ring still holds, then input that never fits
+    for (uint64_t o = evict_from; o < evict_to && o < c->total;) {
+      size_t at = o % c->size;
+      size_t run = c->size - at;
+      uint64_t end = evict_to < c->total ? evict_to : c->total;
+      if (run > end - o)
+        run = end - o;
+      write_all(c->spill_fd, c->data + at, run);
+      o += run;
+    }
+    if (evict_to > c->total)
+      write_all(c->spill_fd, data, evict_to - c->total);
+  }
+  if (n > c->size) { // only the tail of the input survives
+    c->total += n - c->size;
+    data += n - c->size;
+    n = c->size;
+  }
+  while (n > 0) {
+    size_t at = c->total % c->size;
+    size_t run = c->size - at < n ? c->size - at : n;
+    memcpy(c->data + at, data, run);
+    c->total += run;
+    data += run;
+    n -= run;
+  }
+}
+
+void *capture_drainer_main(void *arg) {
+  (void)arg;
+  char chunk[65536];
+  while (1) {
+    struct epoll_event events[16];
+    int n = epoll_wait(capture_epoll_fd, events, 16, -1);
+    for (int i = 0; i < n; i++) {
+      struct capture *c = (struct capture *)events[i].data.ptr;
+      ssize_t got = read(c->fd, chunk, sizeof(chunk));
+      if (got == -1 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      pthread_mutex_lock(&c->lock);
+      if (got > 0)
+        capture_append(c, chunk, got);
+      else {
+        epoll_ctl(capture_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        c->closed = true;
+      }
+      // under the lock, so a finished capture is never released in between
+      uint64_t one = 1;
+      write(c->notify_fd, &one, sizeof(one));
+      pthread_mutex_unlock(&c->lock);
+    }
+  }
+  return NULL;
+}
+
+bool capture_done(struct capture *c);
+
+/**
+ * Find where a new capture can go: a free slot or else the oldest finished
+ * capture, which has the lowest id. Running jobs are never evicted.
+ * @return slot, NULL when every one holds a running job
+ */
+struct capture *capture_slot() {
+  struct capture *c = NULL;
+  for (int i = 0; !c && i < MAX_CAPTURES; i++)
+    if (captures[i].id == 0)
+      c = &captures[i];
+  if (c)
+    return c;
+  for (int i = 0; i < MAX_CAPTURES; i++)
+    if (capture_done(&captures[i]) && (!c || captures[i].id < c->id))
+      c = &captures[i];
+  return c;
+}
+
+/**
+ * Make the pipe a background job will write to, when capturing is on. It
+ * is decided here, before the fork, whether the output can be kept: a job
+ * that cannot be recorded writes to the terminal instead, since closing
+ * its pipe later would kill it with SIGPIPE.
+ * @param  p filled with the pipe, or with -1s when not capturing
+ */
+void capture_prepare(int p[2]) {
+  p[0] = p[1] = -1;
+  bool job_slot = false;
+  for (int i = 0; i < MAX_JOBS; i++)
+    job_slot |= jobs[i].id == 0;
+  if (capture_jobs && job_slot && capture_slot() &&
+      pipe2(p, O_CLOEXEC) == -1)
+    p[0] = p[1] = -1;
+}
+
+/**
+ * In the job's process: send stdout and stderr into the capture pipe
+ */
+void capture_child(int p[2]) {
+  if (p[0] == -1)
+    return;
+  dup2(p[1], STDOUT_FILENO);
+  dup2(p[1], STDERR_FILENO);
+  close(p[0]);
+  close(p[1]);
+}
+
+struct capture *capture_for(int id) {
+  for (int i = 0; id && i < MAX_CAPTURES; i++)
+    if (captures[i].id == id)
+      return &captures[i];
+  return NULL;
+}
+
+bool capture_done(struct capture *c) {
+  pthread_mutex_lock(&c->lock);
+  bool done = c->closed;
+  pthread_mutex_unlock(&c->lock);
+  return done;
+}
+
+void capture_release(struct capture *c) {
+  if (c->spill_fd != -1)
+    close(c->spill_fd);
+  close(c->notify_fd);
+  pthread_mutex_destroy(&c->lock);
+  free(c->data);
+  free(c->text);
+  c->id = 0;
+}
+
+/**
+ * In the shell: hand the read end of the pipe to the drainer thread
+ * @param text  command line of the job, NULL if it was not recorded
+ * @return      id of the new capture, 0 for none
+ */
+int capture_attach(int p[2], const char *text) {
+  if (p[0] == -1)
+    return 0;
+  close(p[1]);
+  struct capture *c = capture_slot(); // found free by capture_prepare
+  if (text == NULL || c == NULL) { // nowhere to keep it: let it go
+    close(p[0]);
+    return 0;
+  }
+  if (c->id)
+    capture_release(c);
+
+  if (capture_epoll_fd == -1) {
+    capture_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    // the drainer must never be the thread a signal for the shell lands on
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, capture_drainer_main, NULL);
+    pthread_detach(drainer);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  }
+  memset(c, 0, sizeof(*c));
+  c->id = next_capture_id++;
+  c->text = strdup(text);
+  c->fd = p[0];
+  c->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_mutex_init(&c->lock, NULL);
+  c->size = capture_size;
+  c->data = (char *)malloc(c->size);
+  c->spill_fd = -1;
+  fcntl(c->fd, F_SETFL, O_NONBLOCK);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = c;
+  epoll_ctl(capture_epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+  return c->id;
+}
+
+/**
+ * Copy the bytes of a ring from an absolute offset on
+ * @param  from  first offset wanted, moved up to the oldest one still held
+ * @return       malloc'ed copy, *len bytes long
+ */
+char *capture_read(struct capture *c, uint64_t *from, size_t *len,
+                   bool *closed) {
+  pthread_mutex_lock(&c->lock);
+  uint64_t oldest = c->total > c->size ? c->total - c->size : 0;
+  if (*from < oldest)
+    *from = oldest;
+  *len = c->total - *from;
+  char *copy = (char *)malloc(*len + 1);
+  for (size_t done = 0; done < *len;) {
+    size_t at = (*from + done) % c->size;
+    size_t run = c->size - at < *len - done ? c->size - at : *len - done;
+    memcpy(copy + done, c->data + at, run);
+    done += run;
+  }
+  *closed = c->closed;
+  pthread_mutex_unlock(&c->lock);
+  return copy;
+}
+
+/**
+ * Say how much came before the oldest byte still held
+ */
+void capture_report_gap(struct capture *c, uint64_t wanted, uint64_t got) {
+  // spill_fd and spill_from only change in the shell's own thread; bytes
+  // pushed out before spilling began were dropped
+  uint64_t from = c->spill_fd != -1 ? c->spill_from : got;
+  uint64_t dropped = (got < from ? got : from) - wanted;
+  uint64_t spilled = got - (wanted > from ? wanted : from);
+  if (got > wanted && wanted < from)
+    printf("[... %llu bytes dropped]\n", (unsigned long long)dropped);
+  if (got > wanted && got > from)
+    printf("[... %llu bytes spilled]\n", (unsigned long long)spilled);
+  fflush(stdout);
+}
+
+/**
+ * Stream a job's output as it arrives until it ends or SIGINT
+ */
+void capture_follow(struct capture *c) {
+  sigset_t mask, saved;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, &saved);
+  int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  uint64_t offset = 0;
+  bool closed = false;
+  while (!closed) {
+    uint64_t wanted = offset;
+    size_t len;
+    char *data = capture_read(c, &offset, &len, &closed);
+    capture_report_gap(c, wanted, offset);
+    write_all(STDOUT_FILENO, data, len);
+    free(data);
+    offset += len;
+    if (closed)
+      break;
+    struct pollfd fds[2] = {{c->notify_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    poll(fds, 2, -1);
+    uint64_t count;
+    read(c->notify_fd, &count, sizeof(count));
+    if (fds[1].revents & POLLIN)
+      break;
+  }
+  struct timespec zero = {0, 0};
+  while (sigtimedwait(&mask, NULL, &zero) > 0) // eat the Ctrl+C
+    ;
+  close(signal_fd);
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * joblog [-n LINES | -f] [-s FILE] ID | %JOB
+ * Dump a job's captured output, show its last lines, follow it, or spill
+ * whatever its ring overwrites from now on to FILE. ID names a log, %JOB the
+ * log of a job still in the job table. Without either, list the logs.
+ */
+int builtin_joblog(struct command_t *command) {
+  long lines = -1;
+  bool follow = false;
+  char *spill = NULL;
+  int i = 1;
+  for (; command->args[i] && command->args[i][0] == '-'; i++) {
+    if (strcmp(command->args[i], "-f") == 0)
+      follow = true;
+    else if (strcmp(command->args[i], "-n") == 0 && command->args[i + 1])
+      lines = atol(command->args[++i]);
+    else if (strcmp(command->args[i], "-s") == 0 && command->args[i + 1])
+      spill = command->args[++i];
+    else
+      break;
+  }
+  if (command->args[i] == NULL) {
+    if (command->args[1]) {
+      printf("Usage: joblog [-n LINES | -f] [-s FILE] ID | %%JOB\n");
+      return SUCCESS;
+    }
+    for (int j = 0; j < MAX_CAPTURES; j++) {
+      struct capture *c = &captures[j];
+      if (!c->id)
+        continue;
+      pthread_mutex_lock(&c->lock);
+      printf("%d\t%s\t%llu bytes%s\t%s\n", c->id,
+             c->closed ? "Done" : "Running", (unsigned long long)c->total,
+             c->spill_fd != -1 ? ", spilling" : "", c->text);
+      pthread_mutex_unlock(&c->lock);
+    }
+    return SUCCESS;
+  }
+  char *id = command->args[i];
+  struct capture *c = NULL;
+  if (id[0] == '%') {
+    for (int j = 0; j < MAX_JOBS; j++)
+      if (jobs[j].id && jobs[j].id == atoi(id + 1))
+        c = capture_for(jobs[j].capture_id);
+  } else
+    c = capture_for(atoi(id));
+  if (c == NULL) {
+    printf("-%s: joblog: %s: no captured output\n", sysname, id);
+    return SUCCESS;
+  }
+
+  if (spill) {
+    int fd = open(spill, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      printf("-%s: joblog: %s: %s\n", sysname, spill, strerror(errno));
+      return SUCCESS;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (c->spill_fd != -1)
+      close(c->spill_fd); // a new file carries on where the old one stopped
+    else
+      c->spill_from = c->total > c->size ? c->total - c->size : 0;
+    c->spill_fd = fd;
+    pthread_mutex_unlock(&c->lock);
+    if (lines < 0 && !follow)
+      return SUCCESS;
+  }
+  if (follow) {
+    capture_follow(c);
+    return SUCCESS;
+  }
+
+  uint64_t offset = 0;
+  size_t len;
+  bool closed;
+  char *data = capture_read(c, &offset, &len, &closed);
+  char *start = data;
+  if (lines >= 0) { // keep the last N lines
+    char *s = data + len;
+    if (s > data && s[-1] == '\n')
+      s--;
+    for (long seen = 0; s > data; s--)
+      if (s[-1] == '\n' && ++seen == lines)
+        break;
+    start = lines == 0 ? data + len : s;
+  } else
+    capture_report_gap(c, 0, offset);
+  write_all(STDOUT_FILENO, start, data + len - start);
+  free(data);
+  return SUCCESS;
+}
+
+/**
+ * Remember a background job and announce it like other shells do
+ * @param settings run controls of the job, NULL for none
+ * @param capture  pipe from capture_prepare carrying the job's output
+ * @return         job id, 0 when the table is full
+ */
+int add_job(pid_t pid, struct command_t *command,
+            struct job_settings *settings, int capture[2]) {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (jobs[i].id)
+      continue;
+    jobs[i].id = next_job_id++;
+    jobs[i].pid = pid;
+    jobs[i].text = command_text(command);
+    strcpy(jobs[i].settings, settings ? settings->summary : "");
+    printf("[%d] %d\n", jobs[i].id, pid);
+    jobs[i].capture_id = capture_attach(capture, jobs[i].text);
+    return jobs[i].id;
+  }
+  capture_attach(capture, NULL);
+  return 0;
+}
+
+/**
+ * Collect finished background jobs and report them
+ */
+void reap_jobs() {
+  for (int i = 0; i < MAX_JOBS; i++) {
+    int status;
+    if (!jobs[i].id || waitpid(jobs[i].pid, &status, WNOHANG) <= 0)
+      continue;
+    printf("[%d] Done (%d)\t%s", jobs[i].id, exit_code_of(status),
+           jobs[i].text);
+    if (capture_for(jobs[i].capture_id))
+      printf("\t(output: joblog %d)", jobs[i].capture_id);
+    printf("\n");
+    free(jobs[i].text);
+    jobs[i].id = 0;
+  }
+  bool any = false;
+  for (int i = 0; i < MAX_JOBS; i++)
+    any |= jobs[i].id != 0;
+  if (!any)
+    next_job_id = 1;
+}
+
+void list_jobs() {
+  reap_jobs();
+  for (int i = 0; i < MAX_JOBS; i++) {
+    if (!jobs[i].id)
+      continue;
+    printf("[%d] %d Running\t%s", jobs[i].id, jobs[i].pid, jobs[i].text);
+    if (jobs[i].settings[0])
+      printf("\t(%s)", jobs[i].settings);
+    printf("\n");
+  }
+}
+
+/**
+ * Parse a CPU list such as "4-7" or "0,2,8-11"
+ */
+bool parse_cpu_list(const char *text, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*text) {
+    char *end;
+    long lo = strtol(text, &end, 10), hi = lo;
+    if (end == text)
+      return false;
+    if (*end == '-') {
+      text = end + 1;
+      hi = strtol(text, &end, 10);
+      if (end == text)
+        return false;
+    }
+    if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+      return false;
+    for (long cpu = lo; cpu <= hi; cpu++)
+      CPU_SET(cpu, set);
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return false;
+    text = end;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Parse an I/O scheduling class: idle, be[:0-7] or rt[:0-7]
+ * @return ioprio value, -1 if invalid
+ */
+int parse_ionice(const char *text) {
+  int klass, level = 4;
+  if (strcmp(text, "idle") == 0)
+    return 3 << IOPRIO_CLASS_SHIFT;
+  if (strncmp(text, "be", 2) == 0)
+    klass = 2;
+  else if (strncmp(text, "rt", 2) == 0)
+    klass = 1;
+  else
+    return -1;
+  if (text[2] == ':')
+    level = atoi(text + 3);
+  else if (text[2] != '\0')
+    return -1;
+  if (level < 0 || level > 7)
+    return -1;
+  return klass << IOPRIO_CLASS_SHIFT | level;
+}
+
+/**
+ * Parse the options of 'run' up to the wrapped command
+ * @return index of the command's name in args, -1 on a bad option
+ */
+int parse_job_settings(struct command_t *command,
+                       struct job_settings *settings) {
+  memset(settings, 0, sizeof(*settings));
+  int i = 1;
+  for (; command->args[i] != NULL; i++) {
+    char *opt = command->args[i], *value = command->args[i + 1];
+    if (strcmp(opt, "--") == 0)
+      return command->args[i + 1] ? i + 1 : -1;
+    if (strncmp(opt, "--", 2) != 0)
+      break;
+    if (value == NULL)
+      return -1;
+    if (strcmp(opt, "--cpus") == 0) {
+      if (!parse_cpu_list(value, &settings->cpus))
+        return -1;
+      settings->has_cpus = true;
+    } else if (strcmp(opt, "--nice") == 0) {
+      char *end;
+      settings->nice = strtol(value, &end, 10);
+      if (*end || end == value)
+        return -1;
+      settings->has_nice = true;
+    } else if (strcmp(opt, "--ionice") == 0) {
+      if ((settings->ioprio = parse_ionice(value)) == -1)
+        return -1;
+    } else if (strcmp(opt, "--mem") == 0) {
+      if ((settings->mem = parse_size(value)) <= 0)
+        return -1;
+    } else
+      return -1;
+    size_t len = strlen(settings->summary);
+    snprintf(settings->summary + len, sizeof(settings->summary) - len,
+             "%s%s=%s", len ? " " : "", opt + 2, value);
+    i++;
+  }
+  return command->args[i] ? i : -1;
+}
+
+/**
+ * Apply run controls to the calling process; children inherit them
+ * @return false, with a message, if one of them could not be applied
+ */
+bool apply_job_settings(struct job_settings *settings) {
+  if (settings->has_cpus &&
+      sched_setaffinity(0, sizeof(cpu_set_t), &settings->cpus) == -1) {
+    fprintf(stderr, "run: cpus: %s\n", strerror(errno));
+    return false;
+  }
+  if (settings->has_nice &&
+      setpriority(PRIO_PROCESS, 0, settings->nice) == -1) {
+    fprintf(stderr, "run: nice: %s\n", strerror(errno));
+    return false;
+  }
+  if (settings->ioprio &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, settings->ioprio) == -1) {
+    fprintf(stderr, "run: ionice: %s\n", strerror(errno));
+    return false;
+  }
+  if (settings->mem) {
+    struct rlimit limit = {settings->mem, settings->mem};
+    if (setrlimit(RLIMIT_AS, &limit) == -1) {
+      fprintf(stderr, "run: mem: %s\n", strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Zygote
+// A small helper, re-exec'ed from the shell binary at startup so its address
+// space stays minimal, forks and execs external commands on the shell's
+// behalf. Forking the shell itself gets slower as it grows (page tables,
+// copy-on-write faults); forking the zygote costs the same all session long.
+// The shell sends argv, the environment, its umask, job settings and, as
+// SCM_RIGHTS, the command's stdin/stdout/stderr plus the shell's working
+// directory in one message; the zygote answers with the pid and later with
+// the exit status.
+#define ZYGOTE_MAX_MESSAGE (1 << 18)
+
+enum zygote_reply_type { ZYGOTE_STARTED, ZYGOTE_EXITED, ZYGOTE_FAILED };
+
+struct zygote_request {
+  uint32_t argc, envc; // strings follow the header, NUL terminated
+  mode_t umask;
+  bool has_settings;
+  struct job_settings settings;
+};
+
+struct zygote_reply {
+  int type;
+  pid_t pid;
+  int status; // waitpid status for ZYGOTE_EXITED
+};
+
+int zygote_fd = -1; // shell's end of the zygote socket, -1 when off
+pid_t zygote_pid = 0;
+pid_t zygote_owner = 0; // forked children of the shell must not use it
+
+/**
+ * Open the redirect files of a command without touching our own descriptors
+ * @param  fds filled with the files, -1 where there is no redirect
+ * @return     false, with a message, if a file could not be opened
+ */
+bool open_redirect_fds(struct command_t *command, int fds[3]) {
+  fds[0] = fds[1] = fds[2] = -1;
+  if (command->redirects[0])
+    fds[0] = open(command->redirects[0], O_RDONLY | O_CLOEXEC);
+  if (command->redirects[1])
+    fds[1] = open(command->redirects[1],
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (command->redirects[2]) {
+    if (fds[1] != -1)
+      close(fds[1]);
+    fds[1] = open(command->redirects[2],
+                  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  for (int i = 0; i < 3; i++) {
+    int r = i == 1 && command->redirects[2] ? 2 : i;
+    if (command->redirects[r] && fds[i] == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[r],
+              strerror(errno));
+      for (int j = 0; j < 3; j++)
+        if (fds[j] != -1)
+          close(fds[j]);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Body of the zygote process: serve spawn requests until the shell closes
+ * its end of the socket
+ */
+int zygote_main(int fd) {
+  fcntl(fd, F_SETFD, FD_CLOEXEC); // inherited across our exec, not further
+  signal(SIGINT, SIG_IGN); // Ctrl+C is for the foreground job, not for us
+  signal(SIGQUIT, SIG_IGN);
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  char *message = (char *)malloc(ZYGOTE_MAX_MESSAGE);
+
+  while (1) {
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) == -1)
+      continue;
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      read(signal_fd, &info, sizeof(info));
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct zygote_reply reply = {ZYGOTE_EXITED, pid, status};
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+      }
+    }
+    if (!(fds[0].revents & (POLLIN | POLLHUP)))
+      continue;
+
+    int passed[4] = {-1, -1, -1, -1}; // stdin, stdout, stderr, cwd
+    char control[CMSG_SPACE(sizeof(passed))];
+    struct iovec iov = {message, ZYGOTE_MAX_MESSAGE - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n == 0 || (n == -1 && errno != EINTR))
+      break; // the shell is gone
+    if (n == -1)
+      continue;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c && c->cmsg_type == SCM_RIGHTS) {
+      size_t got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(passed, CMSG_DATA(c),
+             sizeof(int) * (got < 4 ? got : 4));
+    }
+    message[n] = '\0';
+
+    struct zygote_request *request = (struct zygote_request *)message;
+    char **strings = (char **)malloc(sizeof(char *) *
+                                     (request->argc + request->envc + 2));
+    char *s = message + sizeof(*request);
+    for (uint32_t i = 0; i < request->argc + request->envc; i++) {
+      strings[i + (i >= request->argc)] = s;
+      s += strlen(s) + 1;
+    }
+    strings[request->argc] = NULL;
+    strings[request->argc + request->envc + 1] = NULL;
+
+    pid_t pid = request->argc > 0 ? fork() : -1;
+    if (pid == 0) {
+      sigprocmask(SIG_UNBLOCK, &mask, NULL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+      for (int i = 0; i < 3; i++)
+        dup2(passed[i], i);
+      if (fchdir(passed[3]) == -1) {
+        fprintf(stderr, "-%s: cd: %s\n", sysname, strerror(errno));
+        exit(1);
+      }
+      umask(request->umask);
+      if (request->has_settings && !apply_job_settings(&request->settings))
+        exit(1);
+      environ = strings + request->argc + 1;
+      struct command_t command;
+      memset(&command, 0, sizeof(command));
+      command.name = strings[0];
+      command.args = strings;
+      command.arg_count = request->argc;
+      exec_with_path(&command);
+    }
+    for (int i = 0; i < 4; i++)
+      if (passed[i] != -1)
+        close(passed[i]);
+    free(strings);
+    struct zygote_reply reply = {pid == -1 ? ZYGOTE_FAILED : ZYGOTE_STARTED,
+                                 pid, 0};
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+  }
+  return 0;
+}
+
+/**
+ * Start the zygote from a fresh image of this binary
+ * @return false if it could not be started
+ */
+bool zygote_start() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+    return false;
+  int size = ZYGOTE_MAX_MESSAGE;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  pid_t pid = fork();
+  if (pid == 0) {
+    char fd_text[16];
+    int fd = dup(sv[1]); // without close-on-exec
+    snprintf(fd_text, sizeof(fd_text), "%d", fd);
+    execl("/proc/self/exe", "shellish-zygote", "--zygote", fd_text, NULL);
+    exit(zygote_main(sv[1])); // no /proc: serve from this copy instead
+  }
+  close(sv[1]);
+  if (pid == -1) {
+    close(sv[0]);
+    return false;
+  }
+  zygote_fd = sv[0];
+  zygote_pid = pid;
+  zygote_owner = getpid();
+  return true;
+}
+
+void zygote_stop() {
+  if (zygote_fd == -1 || getpid() != zygote_owner)
+    return;
+  close(zygote_fd); // the zygote exits when its socket hangs up
+  waitpid(zygote_pid, NULL, 0);
+  zygote_fd = -1;
+  zygote_pid = 0;
+}
+
+/**
+ * Run a single external command in the foreground through the zygote
+ * @param  settings run controls for the job, NULL for none
+ * @return          false when the zygote could not take it, so the caller
+ *                  should fork the command itself
+ */
+bool zygote_run(struct command_t *command, struct job_settings *settings) {
+  if (zygote_fd == -1 || getpid() != zygote_owner)
+    return false;
+  int fds[3];
+  if (!open_redirect_fds(command, fds)) {
+    last_status = 1;
+    return true;
+  }
+  char *message = (char *)malloc(ZYGOTE_MAX_MESSAGE);
+  struct zygote_request *request = (struct zygote_request *)message;
+  memset(request, 0, sizeof(*request));
+  request->umask = umask(0);
+  umask(request->umask);
+  if (settings) {
+    request->has_settings = true;
+    request->settings = *settings;
+  }
+  size_t len = sizeof(*request);
+  bool fits = true;
+  for (int part = 0; part < 2 && fits; part++) {
+    char **strings = part == 0 ? command->args : environ;
+    for (int i = 0; strings[i] && fits; i++) {
+      size_t n = strlen(strings[i]) + 1;
+      fits = len + n < ZYGOTE_MAX_MESSAGE;
+      if (!fits)
+        break;
+      memcpy(message + len, strings[i], n);
+      len += n;
+      if (part == 0)
+        request->argc++;
+      else
+        request->envc++;
+    }
+  }
+
+  int passed[4];
+  for (int i = 0; i < 3; i++)
+    passed[i] = fds[i] != -1 ? fds[i] : i;
+  passed[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (passed[3] == -1) {
+    for (int i = 0; i < 3; i++)
+      if (fds[i] != -1)
+        close(fds[i]);
+    free(message);
+    return false;
+  }
+  char control[CMSG_SPACE(sizeof(passed))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {message, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(passed));
+  memcpy(CMSG_DATA(c), passed, sizeof(passed));
+
+  fflush(stdout);
+  bool sent = fits && sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) != -1;
+  free(message);
+  for (int i = 0; i < 3; i++)
+    if (fds[i] != -1)
+      close(fds[i]);
+  close(passed[3]);
+  if (!sent) {
+    if (fits) // the zygote died, stop using it
+      zygote_stop();
+    return false;
+  }
+
+  // Replies come in order: our pid first, then exits until ours shows up
+  struct zygote_reply reply;
+  pid_t pid = 0;
+  while (recv(zygote_fd, &reply, sizeof(reply), 0) == sizeof(reply)) {
+    if (reply.type == ZYGOTE_FAILED) {
+      last_status = 126;
+      return true;
+    }
+    if (reply.type == ZYGOTE_STARTED)
+      pid = reply.pid;
+    else if (reply.pid == pid) {
+      last_status = exit_code_of(reply.status);
+      return true;
+    }
+  }
+  fprintf(stderr, "-%s: zygote: %s\n", sysname,
+          errno ? strerror(errno) : "exited");
+  zygote_stop();
+  last_status = 1;
+  return true;
+}
+
+/**
+ * spawnbench [-n COUNT] [--ballast SIZE] [command [args...]]
+ * Launch a command COUNT times in the foreground, forking the shell and
+ * then through the zygote, and report launches per second for both. The
+ * ballast grows the shell by SIZE of touched memory first, which is what
+ * makes forking the shell slow.
+ */
+int builtin_spawnbench(struct command_t *command) {
+  long count = 200, ballast = 0;
+  int i = 1;
+  for (; command->args[i] && command->args[i][0] == '-'; i += 2) {
+    if (command->args[i + 1] == NULL)
+      break;
+    if (strcmp(command->args[i], "-n") == 0)
+      count = atol(command->args[i + 1]);
+    else if (strcmp(command->args[i], "--ballast") == 0)
+      ballast = parse_size(command->args[i + 1]);
+    else
+      break;
+  }
+  if (count <= 0 || ballast < 0 ||
+      (command->args[i] && command->args[i][0] == '-')) {
+    printf("Usage: spawnbench [-n COUNT] [--ballast SIZE] [command"
+           " [args...]]\n");
+    return SUCCESS;
+  }
+  char *default_args[] = {"true", NULL};
+  struct command_t target;
+  if (command->args[i])
+    target = subcommand(command, i);
+  else {
+    memset(&target, 0, sizeof(target));
+    target.name = default_args[0];
+    target.args = default_args;
+    target.arg_count = 1;
+  }
+
+  char *memory = NULL;
+  if (ballast) {
+    memory = (char *)mmap(NULL, ballast, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      printf("-%s: spawnbench: %s\n", sysname, strerror(errno));
       return SUCCESS;
     }
+    memset(memory, 1, ballast);
+  }
+  bool own_zygote = zygote_fd == -1 && zygote_start();
+
+  path_prime(&target);
+  for (int mode = 0; mode < 2; mode++) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long done = 0;
+    for (; done < count; done++) {
+      if (mode == 1) {
+        if (!zygote_run(&target, NULL))
+          break;
+        continue;
+      }
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0)
+        exec_with_path(&target);
+      int status;
+      waitpid(pid, &status, 0);
+      last_status = exit_code_of(status);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (done < count)
+      printf("%-7s unavailable\n", "zygote");
+    else
+      printf("%-7s %8.0f launches/s  (%ld in %.3fs)\n",
+             mode == 0 ? "fork" : "zygote", done / seconds, done, seconds);
+  }
+
+  if (own_zygote)
+    zygote_stop();
+  if (memory)
+    munmap(memory, ballast);
+  return SUCCESS;
+}
+
+/**
+ * run [--cpus LIST] [--nice N] [--ionice CLASS] [--mem SIZE] -- cmd ...
+ * The job gets its own process with the controls applied before anything
+ * is exec'ed, so every stage of a pipeline, fused ones included, inherits
+ * them.
+ */
+int builtin_run(struct command_t *command) {
+  struct job_settings settings;
+  int first = parse_job_settings(command, &settings);
+  if (first == -1) {
+    printf("Usage: run [--cpus LIST] [--nice N] [--ionice idle|be[:N]|rt[:N]]"
+           " [--mem SIZE] -- command [args...]\n");
+    return SUCCESS;
+  }
+  struct command_t inner = subcommand(command, first);
+  inner.next = command->next;
+  inner.background = false;
+  for (int i = 0; i < 3; i++)
+    inner.redirects[i] = command->redirects[i];
+
+  if (!command->background && !inner.next && !is_builtin(&inner) &&
+      zygote_run(&inner, &settings))
+    return SUCCESS;
+
+  int capture[2];
+  if (command->background)
+    capture_prepare(capture);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (command->background)
+      capture_child(capture);
+    if (!apply_job_settings(&settings))
+      exit(1);
+    if (!inner.next && !is_builtin(&inner)) { // single program: exec here
+      if (!apply_redirects(&inner))
+        exit(1);
+      exec_with_path(&inner);
+    }
+    process_command(&inner);
+    exit(last_status);
+  }
+  if (command->background)
+    add_job(pid, &inner, &settings, capture);
+  else {
+    int status;
+    waitpid(pid, &status, 0);
+    last_status = exit_code_of(status);
+  }
+  return SUCCESS;
+}
+
+// Command substitution
+// $(...) and `...` are replaced by the output of the command inside before
+// the line is parsed. A lone streaming builtin (cut, head, wc, grep, tr) runs
+// right here into a memory buffer, anything else runs in a child whose output
+// is read from a pipe. Either way the output is word split in place.
+
+/**
+ * Find the end of a substitution body
+ * @param  start first byte after "$(" or "`"
+ * @param  close ')' or '`'
+ * @return       the closing byte, NULL when the substitution is unterminated
+ */
+char *substitution_end(char *start, char close) {
+  int depth = 0;
+  char quote = 0;
+  for (char *s = start; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+      continue;
+    }
+    if (close == '`') { // backticks do not nest
+      if (*s == '`')
+        return s;
+      continue;
+    }
+    if (quote) {
+      if (*s == quote)
+        quote = 0;
+    } else if (*s == '\'' || *s == '"')
+      quote = *s;
+    else if (*s == '$' && s[1] == '(') {
+      depth++;
+      s++;
+    } else if (*s == '(')
+      depth++;
+    else if (*s == ')' && depth-- == 0)
+      return s;
+  }
+  return NULL;
+}
+
+/**
+ * Run a streaming builtin in this process with its output going to memory
+ * @param  output set to a malloc'ed block holding the output after
+ *                ARENA_HEADER spare bytes, NULL when there is none
+ * @return        false when the command is not one that can run this way
+ */
+bool capture_in_process(struct command_t *command, char **output,
+                        size_t *len) {
+  struct fuse_filter *filter = fuse_filter_for(command);
+  if (!filter || command->next || command->redirects[1] ||
+      command->redirects[2])
+    return false;
+  struct fuse_in in;
+  struct fuse_out out;
+  memset(&in, 0, sizeof(in));
+  memset(&out, 0, sizeof(out));
+  in.fd = STDIN_FILENO;
+  out.memory_sink = true;
+  out.memory_len = ARENA_HEADER; // the output block can join an arena
+  if (command->redirects[0]) {
+    in.fd = open(command->redirects[0], O_RDONLY | O_CLOEXEC);
+    if (in.fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0],
+              strerror(errno));
+      last_status = 1;
+      *output = NULL;
+      *len = 0;
+      return true;
+    }
+    in.close_fd = true;
+  }
+  last_status = filter->run(command, &in, &out);
+  fuse_out_flush(&out);
+  if (in.close_fd)
+    close(in.fd);
+  free(in.block);
+  free(in.line);
+  *output = out.memory;
+  *len = out.memory ? out.memory_len - ARENA_HEADER : 0;
+  return true;
+}
+
+/**
+ * Run a command line in a child and collect its standard output, growing
+ * the buffer geometrically. The block is laid out as for capture_in_process.
+ */
+void capture_from_child(struct command_t *command, char **output,
+                        size_t *len) {
+  int p[2];
+  *output = NULL;
+  *len = 0;
+  if (pipe2(p, O_CLOEXEC) == -1) {
+    last_status = 1;
+    return;
+  }
+  path_prime(command);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(p[1], STDOUT_FILENO);
+    if (!command->next && !is_builtin(command)) {
+      if (!apply_redirects(command))
+        exit(1);
+      exec_with_path(command);
+    }
+    process_command(command);
+    fflush(stdout);
+    exit(last_status);
+  }
+  close(p[1]);
+  size_t cap = 0, used = ARENA_HEADER;
+  char *buf = NULL;
+  while (pid != -1) {
+    if (used + 1 >= cap) {
+      cap = cap ? cap * 2 : 4096;
+      buf = (char *)realloc(buf, cap);
+    }
+    ssize_t n = read(p[0], buf + used, cap - used - 1);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    used += n;
+  }
+  *len = used - ARENA_HEADER;
+  close(p[0]);
+  int status;
+  if (pid != -1 && waitpid(pid, &status, 0) == pid)
+    last_status = exit_code_of(status);
+  *output = buf;
+}
+
+/**
+ * Run the command inside a substitution and return its output ready to be
+ * split: trailing newlines dropped, other newlines and tabs turned into
+ * spaces
+ * @param  text substitution body, parsed with parse_line so it can nest
+ * @return      malloc'ed block holding the NUL terminated output after
+ *              ARENA_HEADER spare bytes, so an arena can adopt it
+ */
+char *capture_output(char *text, size_t *len) {
+  struct command_t *command =
+      (struct command_t *)calloc(1, sizeof(struct command_t));
+  char *output = NULL;
+  *len = 0;
+  parse_line(text, command);
+  command->background = false;
+  if (command->name[0] || command->redirects[0] || command->redirects[1] ||
+      command->redirects[2]) {
+    if (!capture_in_process(command, &output, len))
+      capture_from_child(command, &output, len);
   }
-  if (strcmp(command->name, "cut") == 0) {
-    
-    char delimiter = '\t'; // Deault delimeter is tab
-    char *fields_string = NULL;
-    int delimiter_seen = 0; 
-    int field_seen = 0;
+  free_command(command);
+  if (output == NULL)
+    output = (char *)malloc(ARENA_HEADER + 1);
+  char *data = output + ARENA_HEADER;
+  while (*len > 0 && data[*len - 1] == '\n')
+    (*len)--;
+  data[*len] = '\0';
+  for (size_t i = 0; i < *len; i++)
+    if (data[i] == '\n' || data[i] == '\t' || data[i] == '\0')
+      data[i] = ' ';
+  return output;
+}
 
-    for (int i = 1; command->args[i] != NULL; i++){
-    
-      if (strcmp(command->args[i], "-d") == 0 && delimiter_seen == 0){
-        if (command->args[i + 1] == NULL) {
-          printf("Missing delimiter\n");
-          return SUCCESS;
+/**
+ * Cut the substitutions out of a line in place, leaving a two byte marker
+ * (SUBST_MARK, 0x80 + index) where each one was. Their bodies only run
+ * when parse_command reaches the argument holding the marker, so their
+ * output can only ever become argument words, never operators.
+ */
+void mark_substitutions(char *buf, struct substitutions *subs) {
+  bool in_single = false;
+  for (char *s = buf; *s && subs->count < SUBST_MAX; s++) {
+    char *body = NULL, *end = NULL;
+    if (*s == '\'' )
+      in_single = !in_single;
+    else if (in_single)
+      continue;
+    else if (*s == '\\' && s[1])
+      s++; // keep escapes for parse_command
+    else if (*s == '$' && s[1] == '(') {
+      body = s + 2;
+      end = substitution_end(body, ')');
+    } else if (*s == '`') {
+      body = s + 1;
+      end = substitution_end(body, '`');
     }
-        delimiter= command->args[i+1][0];
-        delimiter_seen++;
-        i++;
-      }
+    if (end == NULL)
+      continue;
+    subs->bodies[subs->count] = strndup(body, end - body);
+    s[0] = SUBST_MARK;
+    s[1] = (char)(0x80 + subs->count++);
+    memmove(s + 2, end + 1, strlen(end + 1) + 1);
+    s++;
+  }
+}
 
-      else if (strncmp(command->args[i], "-f", 2) == 0 && field_seen == 0) {
-    
-        fields_string = &command->args[i][2]; 
+/**
+ * Index of the substitution a marker at s refers to, -1 when s is not one
+ */
+int substitution_at(const char *s) {
+  int index = (unsigned char)s[1] - 0x80;
+  if (*s != SUBST_MARK || line_substitutions == NULL || index < 0 ||
+      index >= line_substitutions->count)
+    return -1;
+  return index;
+}
 
-        if (fields_string[0] == '\0') { // If nothing written after -f
-          printf("Missing field after -f\n");
-          return SUCCESS;
-      }
-        field_seen = 1;
+/**
+ * Expand the substitution markers of one token into argument words. The
+ * text ends up in the command's arena: a token that is a single
+ * substitution keeps the output block where it was captured, others are
+ * assembled there once. Words are then split in place.
+ * @param  split  split the result at whitespace, false for quoted tokens
+ *                and redirect targets
+ * @return        malloc'ed array of *count words owned by the arena
+ */
+char **substitution_words(struct command_t *command, const char *token,
+                          bool split, size_t *count) {
+  if (!command->arena)
+    command->arena = (struct arena *)calloc(1, sizeof(struct arena));
+  char *outputs[SUBST_MAX];
+  size_t lens[SUBST_MAX], len = 0;
+  int runs = 0;
+  for (const char *s = token; *s; s++) {
+    int index = substitution_at(s);
+    if (index == -1) {
+      len++;
+      continue;
+    }
+    outputs[runs] = capture_output(line_substitutions->bodies[index],
+                                   &lens[runs]);
+    len += lens[runs++];
+    s++;
+  }
+
+  char *text;
+  if (runs == 1 && len == lens[0]) { // nothing around it: no copy at all
+    arena_adopt(command->arena, outputs[0], len + 1);
+    text = outputs[0] + ARENA_HEADER;
+  } else {
+    text = arena_alloc(command->arena, len + 1);
+    size_t at = 0;
+    int run = 0;
+    for (const char *s = token; *s; s++) {
+      if (substitution_at(s) == -1) {
+        text[at++] = *s;
+        continue;
       }
+      memcpy(text + at, outputs[run] + ARENA_HEADER, lens[run]);
+      at += lens[run];
+      free(outputs[run++]);
+      s++;
     }
-    if (field_seen == 0){ // Field has to be provided
-      printf("Missing field\n");
-      return SUCCESS;
+    text[at] = '\0';
+  }
+
+  char **words = (char **)malloc(sizeof(char *) * (len / 2 + 2));
+  *count = 0;
+  if (!split) {
+    words[(*count)++] = text;
+    return words;
+  }
+  char *save = NULL;
+  for (char *word = strtok_r(text, " ", &save); word;
+       word = strtok_r(NULL, " ", &save))
+    words[(*count)++] = word;
+  return words;
+}
+
+/**
+ * Parse a line, running its command substitutions as their arguments are
+ * reached
+ */
+int parse_line(char *buf, struct command_t *command) {
+  struct substitutions subs;
+  struct substitutions *outer = line_substitutions; // capture_output nests
+  subs.count = 0;
+  mark_substitutions(buf, &subs);
+  line_substitutions = &subs;
+  int code = parse_command(buf, command);
+  line_substitutions = outer;
+  for (int i = 0; i < subs.count; i++)
+    free(subs.bodies[i]);
+  return code;
+}
+
+// watch
+// Reruns a pipeline whenever one of the watched paths changes, or on a fixed
+// interval. Everything is driven from one poll loop over an inotify fd, two
+// timerfds (debounce and interval), a signalfd for SIGINT/SIGCHLD and the
+// pipe carrying the current run's output. Nothing sleeps.
+#define WATCH_MAX_TARGETS 64
+#define WATCH_MAX_OUTPUT (1 << 20) // output past this is read and dropped
+#define WATCH_DRAIN_MS 200 // how long output may trail the end of a run
+
+struct watch_target {
+  int wd; // watch descriptor of the directory holding the target
+  struct glob_pattern name; // names in that directory that count
+  bool whole_dir; // the target is the directory itself
+};
+
+struct watch_state {
+  struct command_t inner;
+  char *text; // the command line, for the frame header
+  double interval; // seconds, 0 when only watching paths
+  pid_t pid; // running job, its process group has the same id
+  int out_fd; // read end of its output, -1 when drained
+  char *output;
+  size_t output_len, output_cap;
+  int runs;
+  bool rerun; // a trigger arrived while the previous run was cancelled
+};
+
+bool watch_target_matches(struct watch_target *target, const char *name) {
+  if (target->whole_dir)
+    return true;
+  if (target->name.literal)
+    return strcmp(target->name.literal, name) == 0;
+  return glob_match(&target->name, name);
+}
+
+/**
+ * Watch the directory of a path and remember which names in it matter.
+ * Watching the directory rather than the file keeps working when editors
+ * replace a file by renaming a new one over it.
+ */
+bool watch_add_target(int inotify_fd, const char *path,
+                      struct watch_target *target) {
+  struct stat st;
+  char dir[PATH_MAX];
+  const char *name;
+  memset(target, 0, sizeof(*target));
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(dir, sizeof(dir), "%s", path);
+    target->whole_dir = true;
+    name = NULL;
+  } else {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+      snprintf(dir, sizeof(dir), ".");
+    else if (slash == path)
+      snprintf(dir, sizeof(dir), "/");
+    else
+      snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    name = slash ? slash + 1 : path;
+  }
+  target->wd = inotify_add_watch(inotify_fd, dir,
+                                 IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                     IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                     IN_MASK_ADD);
+  if (target->wd == -1) {
+    printf("-%s: watch: %s: %s\n", sysname, dir, strerror(errno));
+    return false;
+  }
+  if (name)
+    glob_compile(name, &target->name);
+  return true;
+}
+
+/**
+ * Start a run of the watched pipeline in its own process group, with its
+ * stdout and stderr going to a pipe
+ */
+void watch_start(struct watch_state *state, sigset_t *saved_mask) {
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1)
+    return;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    sigprocmask(SIG_SETMASK, saved_mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    dup2(p[1], STDOUT_FILENO);
+    dup2(p[1], STDERR_FILENO);
+    struct command_t *inner = &state->inner;
+    if (!inner->next && !is_builtin(inner)) {
+      if (!apply_redirects(inner))
+        exit(1);
+      exec_with_path(inner);
     }
+    process_command(inner);
+    fflush(stdout);
+    exit(last_status);
+  }
+  close(p[1]);
+  if (pid == -1) {
+    close(p[0]);
+    return;
+  }
+  setpgid(pid, pid); // also done by the child, whichever runs first wins
+  state->pid = pid;
+  state->out_fd = p[0];
+  state->output_len = 0;
+  state->runs++;
+}
 
-    //Turn Fields into int array
-    int fields[100];
-    int field_count = 0;
-    char temp[256];
-    strcpy(temp, fields_string);  //strtok change original string
+/**
+ * Drain whatever the current run has written so far
+ */
+void watch_read_output(struct watch_state *state) {
+  char chunk[16384];
+  ssize_t n = read(state->out_fd, chunk, sizeof(chunk));
+  if (n == -1 && errno == EINTR)
+    return;
+  if (n <= 0) {
+    close(state->out_fd);
+    state->out_fd = -1;
+    return;
+  }
+  size_t keep = (size_t)n;
+  if (state->output_len + keep > WATCH_MAX_OUTPUT)
+    keep = WATCH_MAX_OUTPUT - state->output_len;
+  if (state->output_len + keep > state->output_cap) {
+    state->output_cap = (state->output_len + keep) * 2;
+    state->output = (char *)realloc(state->output, state->output_cap);
+  }
+  memcpy(state->output + state->output_len, chunk, keep);
+  state->output_len += keep;
+}
 
-    char *token = strtok(temp, ",");
-    while (token != NULL) {
-        fields[field_count] = atoi(token);
-        field_count++;
-        token = strtok(NULL, ",");
+/**
+ * Collect what a run wrote before its exit. Something it left running in
+ * the background may hold the pipe open for good, so EOF is only waited
+ * for WATCH_DRAIN_MS; after that the pipe is dropped.
+ */
+void watch_finish_output(struct watch_state *state) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (state->out_fd != -1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long spent = (now.tv_sec - start.tv_sec) * 1000 +
+                 (now.tv_nsec - start.tv_nsec) / 1000000;
+    struct pollfd fd = {state->out_fd, POLLIN, 0};
+    if (spent >= WATCH_DRAIN_MS || poll(&fd, 1, WATCH_DRAIN_MS - spent) == 0) {
+      close(state->out_fd);
+      state->out_fd = -1;
+      break;
     }
+    if (fd.revents)
+      watch_read_output(state);
+  }
+}
+
+/**
+ * Redraw the screen with the output of the finished run: clear, header,
+ * output, all in a single write
+ */
+void watch_draw(struct watch_state *state, int status) {
+  char header[512];
+  time_t now = time(NULL);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+  int n;
+  if (state->interval > 0)
+    n = snprintf(header, sizeof(header), "\033[H\033[2JEvery %gs: %s",
+                 state->interval, state->text);
+  else
+    n = snprintf(header, sizeof(header), "\033[H\033[2JOn change: %s",
+                 state->text);
+  if (n >= (int)sizeof(header))
+    n = sizeof(header) - 1;
+  n += snprintf(header + n, sizeof(header) - n, "    [%s, run %d, exit %d]\n\n",
+                stamp, state->runs, status);
+  if (n >= (int)sizeof(header))
+    n = sizeof(header) - 1;
+
+  char *frame = (char *)malloc(n + state->output_len);
+  memcpy(frame, header, n);
+  if (state->output_len)
+    memcpy(frame + n, state->output, state->output_len);
+  write_all(STDOUT_FILENO, frame, n + state->output_len);
+  free(frame);
+}
+
+/**
+ * Arm a timerfd once (interval 0) or periodically
+ */
+void watch_arm(int timer_fd, double first, double every) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = (time_t)first;
+  spec.it_value.tv_nsec = (long)((first - (time_t)first) * 1e9);
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1; // zero would disarm it
+  spec.it_interval.tv_sec = (time_t)every;
+  spec.it_interval.tv_nsec = (long)((every - (time_t)every) * 1e9);
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+/**
+ * Ask for a new run: start it now, or cancel the one in flight and start
+ * again once it has been reaped
+ */
+void watch_trigger(struct watch_state *state, sigset_t *saved_mask) {
+  if (state->pid > 0) {
+    kill(-state->pid, SIGTERM);
+    state->rerun = true;
+  } else
+    watch_start(state, saved_mask);
+}
 
-    // Read each line
-    char line[1024];
-    char delimeter_string[2] = { delimiter, '\0' };
+int builtin_watch(struct command_t *command) {
+  double interval = 0, debounce_ms = 100;
+  int i = 1;
+  for (; command->args[i] && command->args[i][0] == '-' &&
+         strcmp(command->args[i], "--") != 0;
+       i += 2) {
+    char *value = command->args[i + 1];
+    if (value == NULL)
+      break;
+    if (strcmp(command->args[i], "-n") == 0)
+      interval = strtod(value, NULL);
+    else if (strcmp(command->args[i], "-d") == 0)
+      debounce_ms = strtod(value, NULL);
+    else
+      break;
+  }
+  int paths = i;
+  while (command->args[i] && strcmp(command->args[i], "--") != 0)
+    i++;
+  int path_count = i - paths;
+  if (path_count > WATCH_MAX_TARGETS) {
+    printf("-%s: watch: too many paths (at most %d)\n", sysname,
+           WATCH_MAX_TARGETS);
+    return SUCCESS;
+  }
+  if (command->args[i] == NULL || command->args[i + 1] == NULL ||
+      (path_count == 0 && interval <= 0) || interval < 0 || debounce_ms < 0) {
+    printf("Usage: watch [-n SECONDS] [-d MS] [path|glob...] -- command"
+           " [args...]\n");
+    return SUCCESS;
+  }
 
-    while (fgets(line, sizeof(line), stdin) != NULL) {
+  struct watch_state state;
+  memset(&state, 0, sizeof(state));
+  state.inner = subcommand(command, i + 1);
+  state.inner.next = command->next;
+  for (int r = 0; r < 3; r++)
+    state.inner.redirects[r] = command->redirects[r];
+  state.text = command_text(&state.inner);
+  state.interval = interval;
+  state.out_fd = -1;
 
-      char *running = line;// to protect first line
-      char *token;
-      int token_count = 0;
-      int printed = 0;
+  struct watch_target targets[WATCH_MAX_TARGETS];
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  int debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int interval_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int targets_added = 0;
+  bool ok = inotify_fd != -1 && debounce_fd != -1 && interval_fd != -1;
+  for (int t = 0; ok && t < path_count; t++) {
+    ok = watch_add_target(inotify_fd, command->args[paths + t], &targets[t]);
+    targets_added += ok;
+  }
 
-      while ((token = strsep(&running, delimeter_string)) != NULL) {
-        token_count++;
+  // SIGINT ends the watch, SIGCHLD tells us the run is over
+  sigset_t mask, saved_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+  int signal_fd = ok ? signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC) : -1;
+  ok = ok && signal_fd != -1;
 
-        for (int i = 0; i < field_count; i++){
-          if(token_count== fields[i]){
-            if (printed) {
-              printf("%c", delimiter);
-            }
-            printf("%s", token);
-            printed = 1;
-          }
+  if (ok) {
+    if (interval > 0)
+      watch_arm(interval_fd, interval, interval);
+    watch_start(&state, &saved_mask);
+  }
+  bool done = !ok;
+  int status = 0;
+  while (!done) {
+    struct pollfd fds[5] = {
+        {signal_fd, POLLIN, 0},   {inotify_fd, POLLIN, 0},
+        {debounce_fd, POLLIN, 0}, {interval_fd, POLLIN, 0},
+        {state.out_fd, POLLIN, 0},
+    };
+    if (poll(fds, state.out_fd != -1 ? 5 : 4, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT)
+          done = true;
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      char events[4096]
+          __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t n;
+      bool relevant = false;
+      while ((n = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char *e = events; e < events + n;) {
+          struct inotify_event *event = (struct inotify_event *)e;
+          for (int t = 0; t < targets_added && !relevant; t++)
+            relevant = targets[t].wd == event->wd &&
+                       watch_target_matches(&targets[t],
+                                            event->len ? event->name : "");
+          e += sizeof(struct inotify_event) + event->len;
         }
       }
-      printf("\n");
+      if (relevant) // bursts collapse into one run after the last event
+        watch_arm(debounce_fd, debounce_ms / 1000.0, 0);
+    }
+    uint64_t expirations;
+    if ((fds[2].revents & POLLIN) &&
+        read(debounce_fd, &expirations, sizeof(expirations)) > 0)
+      watch_trigger(&state, &saved_mask);
+    if ((fds[3].revents & POLLIN) &&
+        read(interval_fd, &expirations, sizeof(expirations)) > 0)
+      watch_trigger(&state, &saved_mask);
+    if (state.out_fd != -1 && (fds[4].revents & (POLLIN | POLLHUP)))
+      watch_read_output(&state);
+
+    // A run is complete once it has exited and its output has been collected
+    if (state.pid > 0 && waitpid(state.pid, &status, WNOHANG) == state.pid) {
+      watch_finish_output(&state);
+      state.pid = 0;
+      last_status = exit_code_of(status);
+      if (state.rerun) {
+        state.rerun = false;
+        watch_start(&state, &saved_mask);
+      } else
+        watch_draw(&state, last_status);
+    }
+  }
+
+  if (state.pid > 0) {
+    kill(-state.pid, SIGTERM);
+    waitpid(state.pid, NULL, 0);
+  }
+  if (state.out_fd != -1)
+    close(state.out_fd);
+  for (int t = 0; t < targets_added; t++)
+    if (!targets[t].whole_dir)
+      glob_pattern_free(&targets[t].name);
+  int fds[] = {signal_fd, inotify_fd, debounce_fd, interval_fd};
+  for (int f = 0; f < 4; f++)
+    if (fds[f] != -1)
+      close(fds[f]);
+  // Drop a SIGINT that is still pending before the mask comes off
+  struct timespec zero = {0, 0};
+  sigset_t interrupt;
+  sigemptyset(&interrupt);
+  sigaddset(&interrupt, SIGINT);
+  while (sigtimedwait(&interrupt, NULL, &zero) > 0)
+    ;
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+  free(state.output);
+  free(state.text);
+  return SUCCESS;
+}
+
+int process_command(struct command_t *command) {
+
+
+  // run wraps the whole pipeline that follows it
+  if (strcmp(command->name, "run") == 0)
+    return builtin_run(command);
+  if (strcmp(command->name, "watch") == 0)
+    return builtin_watch(command);
+
+  // PIPE HANDLING 
+  // a lone streaming builtin or mover with '&' is a one stage pipeline
+  bool streaming = fuse_filter_for(command) || mover_for(command);
+  if (command->next || (command->background && streaming)) {
+    if (command->background) { // the whole pipeline runs in a subshell
+      int capture[2];
+      capture_prepare(capture);
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0) {
+        capture_child(capture);
+        exit(run_pipeline(command));
+      }
+      add_job(pid, command, NULL, capture);
+      return SUCCESS;
+    }
+    run_pipeline(command);
+    return SUCCESS;
+  }
+
+  //Built-in Commands
+
+  int r;
+  if (strcmp(command->name, "") == 0 && !redirect_accepts(command))
+    return SUCCESS;
+
+  if (strcmp(command->name, "exit") == 0)
+    return EXIT;
+
+  if (strcmp(command->name, "cd") == 0) {
+    if (command->arg_count > 0) {
+      r = chdir(command->args[1]);
+      if (r == -1)
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+      return SUCCESS;
     }
+  }
+  if (strcmp(command->name, "jobs") == 0) {
+    list_jobs();
+    return SUCCESS;
+  }
+
+  if (strcmp(command->name, "capture") == 0) {
+    if (command->args[1] && strcmp(command->args[1], "on") == 0) {
+      long size = command->args[2] ? parse_size(command->args[2]) : 0;
+      if (size > 0)
+        capture_size = size;
+      capture_jobs = true;
+    } else if (command->args[1] && strcmp(command->args[1], "off") == 0)
+      capture_jobs = false;
+    else
+      printf("background output capture is %s (%zu bytes per job)\n",
+             capture_jobs ? "on" : "off", capture_size);
+    return SUCCESS;
+  }
+  if (strcmp(command->name, "joblog") == 0)
+    return builtin_joblog(command);
+
+  if (strcmp(command->name, "zygote") == 0) {
+    if (command->args[1] && strcmp(command->args[1], "on") == 0) {
+      if (zygote_fd == -1 && !zygote_start())
+        printf("-%s: zygote: %s\n", sysname, strerror(errno));
+    } else if (command->args[1] && strcmp(command->args[1], "off") == 0)
+      zygote_stop();
+    else if (zygote_fd != -1)
+      printf("zygote is on (pid %d)\n", zygote_pid);
+    else
+      printf("zygote is off\n");
+    return SUCCESS;
+  }
+  if (strcmp(command->name, "spawnbench") == 0)
+    return builtin_spawnbench(command);
+
+  if (strcmp(command->name, "fuse") == 0) {
+    if (command->args[1] && strcmp(command->args[1], "on") == 0)
+      fuse_pipelines = true;
+    else if (command->args[1] && strcmp(command->args[1], "off") == 0)
+      fuse_pipelines = false;
+    else
+      printf("pipeline fusion (in-process cut, head, wc, grep, tr, cat, tee) "
+             "is %s\n",
+             fuse_pipelines ? "on" : "off");
+    return SUCCESS;
+  }
+
+  // cut, head, wc, grep -F, tr, and the cat, tee, <in >out data movers
+  if (streaming) {
+    run_pipeline(command);
     return SUCCESS;
   }
 
   // Part3-b chatroom
   if (strcmp(command->name, "chatroom") == 0) {
-    if (command->arg_count < 3) { // Expecting: chatroom <roomname> <username>
-      printf("Usage: chatroom <roomname> <username>\n");
+    // Expecting: chatroom <roomname> <username> [-n N | -t SECONDS]
+    size_t last_n = 20;
+    int64_t since_ms = 0;
+    bool usage = command->args[1] == NULL || command->args[2] == NULL;
+    for (int i = 3; !usage && command->args[i] != NULL; i += 2) {
+      if (command->args[i + 1] == NULL)
+        usage = true;
+      else if (strcmp(command->args[i], "-n") == 0)
+        last_n = atol(command->args[i + 1]);
+      else if (strcmp(command->args[i], "-t") == 0) // last SECONDS of talk
+        since_ms = now_ms() - atol(command->args[i + 1]) * 1000;
+      else
+        usage = true;
+    }
+    if (usage) {
+      printf("Usage: chatroom <roomname> <username> [-n N | -t SECONDS]\n");
       return SUCCESS;
     }
     // command->args[1] is <roomname>, command->args[2] is <username>
-    run_chatroom(command->args[1], command->args[2]);
+    run_chatroom(command->args[1], command->args[2], last_n, since_ms);
     return SUCCESS;
   }
   //Part3-c amiral battı
@@ -855,73 +5655,455 @@ int process_command(struct command_t *command) {
 
   
 
+  path_prime(command);
+  if (!command->background && zygote_run(command, NULL))
+    return SUCCESS;
+  int capture[2];
+  if (command->background)
+    capture_prepare(capture);
+  fflush(stdout);
   pid_t pid = fork();
   if (pid == 0) // child
   {
-
-    // (<) Redirection
-    // Replace stdin with file
-    if (command->redirects[0]){
-      int fd = open(command->redirects[0], O_RDONLY); 
-      dup2(fd, STDIN_FILENO);
-      close(fd);
-    }
-    // (>) Redirection
-    // Create or truncate file
-    if (command->redirects[1]){
-      int fd = open(command->redirects[1],O_WRONLY | O_CREAT | O_TRUNC,0644); 
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-    }
-
-    // (>>) Redirection
-    // Append output to file
-    if (command->redirects[2]){
-      int fd = open(command->redirects[2],O_WRONLY | O_CREAT | O_APPEND,0644);
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-    }
+    if (command->background)
+      capture_child(capture);
+    if (!apply_redirects(command))
+      exit(1);
     exec_with_path(command);
   } 
   else {
-    // TODO: implement background processes here
     if (command->background != true){
-      wait(0); // wait for child process to finish
-    }
-    return SUCCESS;
+      int status;
+      waitpid(pid, &status, 0); // wait for child process to finish
+      last_status = exit_code_of(status);
+    } else
+      add_job(pid, command, NULL, capture);
   }
+  return SUCCESS;
 }
 
 void exec_with_path(struct command_t *command) {
- //MANUAL PATH RESOLUTION
-    char *path = getenv("PATH");
-    int path_len = strlen(path) + 1;
-    char path_copied[4096]; // Path is copied not to modify original file
-    strncpy(path_copied, path, path_len);
-    
-    char *dir = strtok(path_copied, ":");
-    char full_path[4096];
-
-    // Try each directory in PATH
-    while (dir != NULL) {
-      full_path[0] = '\0';
-      strcat(full_path, dir);
-      strcat(full_path, "/");
-      strcat(full_path, command->name);
-      // Try executing constructed path
-      execv(full_path, command->args);
-      dir = strtok(NULL, ":");
+    signal(SIGPIPE, SIG_DFL); // the shell ignores it, programs should not
+    const char *path = path_lookup(command->name);
+    if (path != NULL) {
+      execv(path, command->args);
+      if (errno == ENOENT && path != command->name) { // moved since cached
+        path_forget(command->name);
+        path = path_lookup(command->name);
+        if (path != NULL)
+          execv(path, command->args);
+      }
     }
     printf("-%s: %s: command not found\n", sysname, command->name);
     exit(127);
 }
 
-int main() {
+// Server mode
+// 'shellish --serve SOCKET' keeps one warm shell that runs command lines for
+// local clients. A request carries either an argv vector or a command line,
+// the client's working directory and, as SCM_RIGHTS, the client's stdin,
+// stdout and stderr, so the output never passes through the server. The
+// server resolves the request's programs through its PATH cache, then a
+// forked child takes over the client's descriptors and directory before
+// parsing, so substitutions and globs see what the client would; the reply
+// reports the exit status and the child's resource usage. The layout of both messages is shared with shellish-client.c.
+#define SERVE_MAX_LINE 4096
+#define SERVE_MAX_EVENTS 64
+
+struct serve_request {
+  uint32_t id; // echoed in the reply
+  uint32_t argc; // line holds argc NUL terminated words, 0 for a command line
+  char cwd[PATH_MAX];
+  char line[SERVE_MAX_LINE];
+};
+
+struct serve_reply {
+  uint32_t id;
+  int32_t status; // exit code, -1 when the request was malformed or dropped
+  int64_t utime_us;
+  int64_t stime_us;
+  int64_t maxrss_kb;
+};
+
+struct serve_job {
+  int client_fd; // -1 once the client went away
+  int fds[3];
+  pid_t pid; // 0 while queued
+  struct serve_request request;
+};
+
+struct serve_state {
+  struct serve_job **running; // max_jobs slots
+  int max_jobs;
+  int active;
+  struct serve_job **queue; // ring of jobs waiting for a free slot
+  size_t queue_head, queue_len, queue_cap;
+};
+
+void serve_reply_to(int client_fd, uint32_t id, int status,
+                    struct rusage *usage) {
+  struct serve_reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.id = id;
+  reply.status = status;
+  if (usage) {
+    reply.utime_us = (int64_t)usage->ru_utime.tv_sec * 1000000 +
+                     usage->ru_utime.tv_usec;
+    reply.stime_us = (int64_t)usage->ru_stime.tv_sec * 1000000 +
+                     usage->ru_stime.tv_usec;
+    reply.maxrss_kb = usage->ru_maxrss;
+  }
+  if (client_fd != -1)
+    send(client_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+void serve_job_free(struct serve_job *job) {
+  for (int i = 0; i < 3; i++)
+    if (job->fds[i] != -1)
+      close(job->fds[i]);
+  free(job);
+}
+
+/**
+ * Turn the words of an argv request into a command, taken as they are
+ */
+void serve_argv_command(struct serve_request *request,
+                        struct command_t *command) {
+  command->arg_count = request->argc + 1;
+  command->args = (char **)malloc(sizeof(char *) * command->arg_count);
+  char *word = request->line;
+  for (uint32_t i = 0; i < request->argc; i++) {
+    command->args[i] = strdup(word);
+    word += strlen(word) + 1;
+  }
+  command->args[request->argc] = NULL;
+  command->name = strdup(command->args[0]);
+}
+
+/**
+ * Resolve the programs a request will run into the server's own PATH cache,
+ * which every child inherits warm. Only plain words in command position are
+ * looked at; substitutions are left to the child, which runs them in the
+ * client's directory.
+ */
+void serve_prime(struct serve_request *request) {
+  if (request->argc) {
+    path_lookup(request->line);
+    return;
+  }
+  char line[SERVE_MAX_LINE], *save;
+  strcpy(line, request->line);
+  bool command_word = true;
+  for (char *word = strtok_r(line, " \t", &save); word;
+       word = strtok_r(NULL, " \t", &save)) {
+    if (strcmp(word, "|") == 0) {
+      command_word = true;
+      continue;
+    }
+    if (command_word && !strpbrk(word, "<>$`'\"*?[&"))
+      path_lookup(word);
+    command_word = false;
+  }
+}
+
+/**
+ * Fork a child that takes over the client's descriptors and directory, then
+ * parses the job's request and runs it
+ */
+void serve_start(struct serve_state *state, struct serve_job *job) {
+  serve_prime(&job->request);
+  pid_t pid = fork();
+  if (pid == 0) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    for (int i = 0; i < 3; i++)
+      dup2(job->fds[i], i); // dup2 also clears close-on-exec
+    if (chdir(job->request.cwd) == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, job->request.cwd,
+              strerror(errno));
+      exit(1);
+    }
+    struct command_t *command =
+        (struct command_t *)calloc(1, sizeof(struct command_t));
+    if (job->request.argc)
+      serve_argv_command(&job->request, command);
+    else
+      parse_line(job->request.line, command);
+    path_prime(command); // only substituted names are new to the cache
+    last_status = 0;
+    process_command(command);
+    fflush(stdout);
+    exit(last_status);
+  }
+  for (int i = 0; i < 3; i++) {
+    close(job->fds[i]);
+    job->fds[i] = -1;
+  }
+  if (pid == -1) {
+    serve_reply_to(job->client_fd, job->request.id, 126, NULL);
+    free(job);
+    return;
+  }
+  job->pid = pid;
+  for (int i = 0; i < state->max_jobs; i++) {
+    if (state->running[i] == NULL) {
+      state->running[i] = job;
+      break;
+    }
+  }
+  state->active++;
+}
+
+void serve_submit(struct serve_state *state, struct serve_job *job) {
+  if (state->active < state->max_jobs) {
+    serve_start(state, job);
+    return;
+  }
+  if (state->queue_len == state->queue_cap) {
+    size_t cap = state->queue_cap ? state->queue_cap * 2 : 64;
+    struct serve_job **queue =
+        (struct serve_job **)malloc(cap * sizeof(struct serve_job *));
+    for (size_t i = 0; i < state->queue_len; i++)
+      queue[i] = state->queue[(state->queue_head + i) % state->queue_cap];
+    free(state->queue);
+    state->queue = queue;
+    state->queue_cap = cap;
+    state->queue_head = 0;
+  }
+  state->queue[(state->queue_head + state->queue_len++) % state->queue_cap] =
+      job;
+}
+
+/**
+ * Read one request and its descriptors from a client
+ * @return false when the client hung up
+ */
+bool serve_read_request(struct serve_state *state, int client_fd) {
+  struct serve_job *job = (struct serve_job *)calloc(1, sizeof(*job));
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {&job->request, sizeof(job->request)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  job->fds[0] = job->fds[1] = job->fds[2] = -1;
+  job->client_fd = client_fd;
+  ssize_t n = recvmsg(client_fd, &msg, MSG_CMSG_CLOEXEC);
+  if (n <= 0) {
+    free(job);
+    return n == -1 && (errno == EAGAIN || errno == EINTR);
+  }
+  int received = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(job->fds, CMSG_DATA(c), sizeof(int) * (received < 3 ? received : 3));
+  }
+  if (received != 3 || n != sizeof(job->request) ||
+      (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    serve_reply_to(client_fd, job->request.id, -1, NULL);
+    serve_job_free(job);
+    return true;
+  }
+  job->request.cwd[sizeof(job->request.cwd) - 1] = '\0';
+  job->request.line[sizeof(job->request.line) - 1] = '\0';
+  // every word of an argv request must end inside the line
+  uint32_t words = 0;
+  for (size_t i = 0; i < sizeof(job->request.line); i++)
+    words += job->request.line[i] == '\0';
+  if (words < job->request.argc ||
+      (job->request.argc && job->request.line[0] == '\0')) {
+    serve_reply_to(client_fd, job->request.id, -1, NULL);
+    serve_job_free(job);
+    return true;
+  }
+  serve_submit(state, job);
+  return true;
+}
+
+/**
+ * Forget a client that hung up: its running jobs finish without a reply
+ * and its queued ones are dropped
+ */
+void serve_drop_client(struct serve_state *state, int client_fd) {
+  for (int i = 0; i < state->max_jobs; i++)
+    if (state->running[i] && state->running[i]->client_fd == client_fd)
+      state->running[i]->client_fd = -1;
+  size_t kept = 0;
+  for (size_t i = 0; i < state->queue_len; i++) {
+    struct serve_job *job =
+        state->queue[(state->queue_head + i) % state->queue_cap];
+    if (job->client_fd == client_fd)
+      serve_job_free(job);
+    else
+      state->queue[(state->queue_head + kept++) % state->queue_cap] = job;
+  }
+  state->queue_len = kept;
+  close(client_fd);
+}
+
+/**
+ * Collect finished jobs, answer their clients and start queued jobs in the
+ * freed slots
+ */
+void serve_reap(struct serve_state *state) {
+  int status;
+  struct rusage usage;
+  // wait on our own pids only, background jobs of the shell are reap_jobs'
+  for (int i = 0; i < state->max_jobs; i++) {
+    struct serve_job *job = state->running[i];
+    if (job == NULL || wait4(job->pid, &status, WNOHANG, &usage) != job->pid)
+      continue;
+    serve_reply_to(job->client_fd, job->request.id, exit_code_of(status),
+                   &usage);
+    free(job);
+    state->running[i] = NULL;
+    state->active--;
+  }
+  while (state->active < state->max_jobs && state->queue_len > 0) {
+    struct serve_job *job = state->queue[state->queue_head];
+    state->queue_head = (state->queue_head + 1) % state->queue_cap;
+    state->queue_len--;
+    serve_start(state, job);
+  }
+}
+
+/**
+ * Run the server until SIGINT or SIGTERM
+ * @param  socket_path where to listen, replaced if a stale socket is there
+ * @param  max_jobs    number of command lines allowed to run at once
+ * @return             exit code for main
+ */
+int serve(const char *socket_path, int max_jobs) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "-%s: %s: socket path too long\n", sysname, socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(socket_path);
+  if (listen_fd == -1 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, 128) == -1) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, socket_path, strerror(errno));
+    return 1;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.fd = signal_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+  struct serve_state state;
+  memset(&state, 0, sizeof(state));
+  state.max_jobs = max_jobs;
+  state.running =
+      (struct serve_job **)calloc(max_jobs, sizeof(struct serve_job *));
+  fprintf(stderr, "%s: serving on %s, %d jobs at a time\n", sysname,
+          socket_path, max_jobs);
+
+  bool stopping = false;
+  while (!stopping) {
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+    if (n == -1 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        int client_fd;
+        while ((client_fd = accept4(listen_fd, NULL, NULL,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+          event.events = EPOLLIN;
+          event.data.fd = client_fd;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        }
+      } else if (fd == signal_fd) {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+          if (info.ssi_signo != SIGCHLD)
+            stopping = true;
+        serve_reap(&state);
+      } else if (!serve_read_request(&state, fd)) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        serve_drop_client(&state, fd);
+      }
+    }
+  }
+
+  // Stop taking work, refuse what is queued, let the running jobs finish
+  // and answer them
+  unlink(socket_path);
+  close(listen_fd);
+  while (state.queue_len > 0) {
+    struct serve_job *job = state.queue[state.queue_head];
+    serve_reply_to(job->client_fd, job->request.id, -1, NULL);
+    serve_job_free(job);
+    state.queue_head = (state.queue_head + 1) % state.queue_cap;
+    state.queue_len--;
+  }
+  while (state.active > 0) {
+    struct signalfd_siginfo info;
+    struct pollfd wait_fd = {signal_fd, POLLIN, 0};
+    poll(&wait_fd, 1, -1);
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+      ;
+    serve_reap(&state);
+  }
+  free(state.running);
+  free(state.queue);
+  close(epoll_fd);
+  close(signal_fd);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // fused pipeline stages run in the shell and must not die of SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc >= 3 && strcmp(argv[1], "--zygote") == 0)
+    return zygote_main(atoi(argv[2]));
+  if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 5 && strcmp(argv[3], "--jobs") == 0)
+      max_jobs = atol(argv[4]);
+    if (max_jobs < 1)
+      max_jobs = 1;
+    return serve(argv[2], (int)max_jobs);
+  }
+  // Start it while the shell is still small; SHELLISH_ZYGOTE=1 turns it on
+  if (getenv("SHELLISH_ZYGOTE") && strcmp(getenv("SHELLISH_ZYGOTE"), "0"))
+    zygote_start();
+
   while (1) {
     struct command_t *command =
         (struct command_t *)malloc(sizeof(struct command_t));
     memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
 
+    reap_jobs();
+
     int code;
     code = prompt(command);
     if (code == EXIT)